@@ -61,7 +61,14 @@ alloc_block(void)
 	// super->s_nblocks blocks in the disk altogether.
 
 	// LAB 5: Your code here.
-	panic("alloc_block not implemented");
+	uint32_t blockno;
+
+	for (blockno = 0; blockno < super->s_nblocks; blockno++)
+		if (block_is_free(blockno)) {
+			bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+			flush_block(&bitmap[blockno / 32]);
+			return blockno;
+		}
 	return -E_NO_DISK;
 }
 
@@ -132,7 +139,28 @@ static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
 	// LAB 5: Your code here.
-	panic("file_block_walk not implemented");
+	int r;
+	uint32_t *indirect;
+
+	if (filebno < NDIRECT) {
+		*ppdiskbno = (uint32_t *) f->f_direct + filebno;
+		return 0;
+	}
+	if (filebno >= NDIRECT + NINDIRECT)
+		return -E_INVAL;
+
+	if (f->f_indirect == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block()) < 0)
+			return r;
+		f->f_indirect = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		flush_block(diskaddr(r));
+	}
+	indirect = diskaddr(f->f_indirect);
+	*ppdiskbno = &indirect[filebno - NDIRECT];
+	return 0;
 }
 
 // Set *blk to point at the filebno'th block in file 'f'.
@@ -147,7 +175,20 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	// LAB 5: Your code here.
-	panic("file_get_block not implemented");
+	int r;
+	uint32_t *pdiskbno;
+
+	if ((r = file_block_walk(f, filebno, &pdiskbno, 1)) < 0)
+		return r;
+	if (*pdiskbno == 0) {
+		if ((r = alloc_block()) < 0)
+			return r;
+		*pdiskbno = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		flush_block(diskaddr(r));
+	}
+	*blk = diskaddr(*pdiskbno);
+	return 0;
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
@@ -43,6 +43,10 @@ void	fs_sync(void);
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
 
+/* swap.c */
+void	swap_init(void);
+void	serve_swap(void);
+
 /* test.c */
 void	fs_test(void);
 
@@ -328,6 +328,12 @@ serve(void)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, vpt[VPN(fsreq)], fsreq);
 
+		// A message from the kernel: there are pages to swap.
+		if (whom == 0) {
+			serve_swap();
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
@@ -363,6 +369,7 @@ umain(void)
 	serve_init();
 	fs_init();
 	fs_test();
+	swap_init();
 
 	serve();
 }
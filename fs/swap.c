@@ -0,0 +1,75 @@
+/*
+ * Swap file for the kernel's page reclaim (see kern/swap.h).
+ * The kernel picks the pages; the file server copies each one to or
+ * from a slot of SWAPFILE, one block per slot.
+ */
+
+#include <inc/string.h>
+
+#include "fs.h"
+
+#define SWAPFILE	"/swap"
+#define SWAPSLOTS	1024		// 4MB, about the largest file we can have
+#define SWAPVA		0x0fffe000	// where the kernel maps the pages
+
+static struct File *swapfile;
+
+void
+swap_init(void)
+{
+	int r;
+
+	if ((r = file_open(SWAPFILE, &swapfile)) < 0
+	    && (r = file_create(SWAPFILE, &swapfile)) < 0) {
+		cprintf("swap: cannot create %s: %e\n", SWAPFILE, r);
+		return;
+	}
+	if ((r = file_set_size(swapfile, SWAPSLOTS * BLKSIZE)) < 0) {
+		cprintf("swap: cannot grow %s: %e\n", SWAPFILE, r);
+		return;
+	}
+	if ((r = sys_swap_register(SWAPSLOTS)) < 0)
+		panic("sys_swap_register: %e", r);
+	cprintf("swap: %d slots in %s\n", r, SWAPFILE);
+}
+
+// Copy the page at SWAPVA to swap slot 'slot', or back from it.
+static void
+swap_copy(uint32_t slot, bool out)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(swapfile, slot, &blk)) < 0)
+		panic("swap slot %d: %e", slot, r);
+	// If that allocated the block, write out the block pointer too, or
+	// the bitmap and the file disagree after a reboot.
+	flush_block(swapfile);
+	if (swapfile->f_indirect)
+		flush_block(diskaddr(swapfile->f_indirect));
+	if (out) {
+		memmove(blk, (void *) SWAPVA, BLKSIZE);
+		flush_block(blk);
+	} else
+		memmove((void *) SWAPVA, blk, BLKSIZE);
+
+	// Don't keep swap blocks in the block cache: the kernel is
+	// trying to get memory back.
+	sys_page_unmap(0, blk);
+	sys_page_unmap(0, (void *) SWAPVA);
+	if ((r = sys_swap_done(slot)) < 0)
+		panic("sys_swap_done %d: %e", slot, r);
+}
+
+// Called when the kernel has swapping to do: write out the pages it
+// reclaimed, then read in the ones environments are waiting for.
+void
+serve_swap(void)
+{
+	int slot;
+
+	while ((slot = sys_swap_out((void *) SWAPVA)) >= 0)
+		swap_copy(slot, 1);
+	while ((slot = sys_swap_in((void *) SWAPVA)) >= 0)
+		swap_copy(slot, 0);
+}
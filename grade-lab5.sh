@@ -78,4 +78,28 @@ runtest1 -tag 'spawn via icode [icode]' icode \
 	"init: args: 'init' 'initarg1' 'initarg2'" \
 	'init: exiting' \
 
+# Self-checking tests of the kernel's own extensions
+pts=5
+runtest1 batchtest \
+	'batchtest: OK' \
+
+runtest1 shmtest \
+	'shmtest: shared memory is good' \
+
+runtest1 priotest \
+	'priotest: priorities are good' \
+
+runtest1 clocktest \
+	'sys_time: [0-9]* ns' \
+	'time_ns: [0-9]* ns' \
+
+# Little enough memory that swaptest's 32MB can't all stay in it
+timeout=60
+qemuopts_swap=$qemuopts
+qemuopts="$qemuopts -m 32"
+runtest1 swaptest \
+	'[0-9]* pages ok, [1-9][0-9]* swapped out, [1-9][0-9]* swapped in' \
+
+qemuopts=$qemuopts_swap
+
 showfinal
@@ -0,0 +1,33 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_CLOCK_H
+#define JOS_INC_CLOCK_H
+
+#include <inc/types.h>
+
+// Nanoseconds since boot are computed from the TSC, which the kernel
+// calibrates against the 8253 at boot:
+//	ns = (tsc - ck_tsc_base) * ck_mult >> CLOCK_SHIFT
+#define CLOCK_SHIFT	24
+
+// The clock parameters, in a page the kernel maps read-only at UCLOCK
+// in every environment, so reading the time takes no system call.
+// They don't change after boot.
+struct Clock {
+	uint64_t ck_tsc_base;		// TSC at time 0
+	uint64_t ck_tsc_freq;		// TSC cycles per second
+	uint32_t ck_mult;		// ns per cycle << CLOCK_SHIFT
+};
+
+// Convert a TSC reading to nanoseconds since boot.  The cycles are
+// multiplied in two halves, so nothing overflows for centuries.
+static __inline uint64_t
+clock_tsc2ns(const struct Clock *ck, uint64_t tsc)
+{
+	uint64_t d = tsc - ck->ck_tsc_base;
+
+	return (((d >> 32) * ck->ck_mult) << (32 - CLOCK_SHIFT))
+		+ (((d & 0xFFFFFFFF) * ck->ck_mult) >> CLOCK_SHIFT);
+}
+
+#endif	// !JOS_INC_CLOCK_H
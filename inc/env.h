@@ -34,18 +34,53 @@ typedef int32_t envid_t;
 #define ENV_FREE		0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
+#define ENV_DYING		3	// destroyed while running on another CPU
 
+// Scheduling priorities: a runnable environment only gets the CPU when
+// no environment of a higher priority is runnable.
+#define ENV_NPRIO		4
+#define ENV_PRIO_LOW		0
+#define ENV_PRIO_DEFAULT	1
+#define ENV_PRIO_HIGH		2	// the file server
+#define ENV_PRIO_MAX		(ENV_NPRIO - 1)
+
+// CPU shares for stride scheduling (see kern/sched.h)
+#define ENV_TICKETS_DEFAULT	100
+#define ENV_MAXTICKETS		10000
+
+// CPUs an environment may run on, bit i for CPU i
+#define ENV_AFFINITY_ALL	0xFFFFFFFF
+
+// Cache line size that struct Env is laid out for
+#define ENV_ALIGN		64
+
+// The fields the scheduler and envid2env() look at come first, so that
+// a scan over envs[] touches one cache line per environment; the
+// alignment keeps each Env starting on a line of its own.
 struct Env {
-	struct 	Trapframe env_tf;	// Saved registers
-	LIST_ENTRY(Env) env_link;	// Free list link pointers
-	envid_t env_id;			// Unique environment identifier
-	envid_t env_parent_id;		// env_id of this env's parent
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint32_t env_priority;		// ENV_PRIO_*
+	uint32_t env_level;		// MLFQ level (see kern/sched.h)
+	uint32_t env_ticks;		// timer ticks used at that level
+	uint32_t env_tickets;		// stride scheduling share
+	uint64_t env_pass;		// stride scheduling virtual time
+	int32_t env_rqcpu;		// CPU whose run queue it is on, or -1
+	uint32_t env_affinity;		// CPUs it may run on
+	envid_t env_id;			// Unique environment identifier
+	envid_t env_parent_id;		// env_id of this env's parent
+	LIST_ENTRY(Env) env_link;	// Free list link pointers
+	TAILQ_ENTRY(Env) env_runq;	// Run queue link, while runnable
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
+	int32_t env_cpunum;		// CPU it is current on, or -1
+
+	struct 	Trapframe env_tf;	// Saved registers
+
+	uint64_t env_cycles;		// TSC cycles charged to this env
+	uint32_t env_migrations;	// times moved to another CPU's queue
 
 	// Exception handling
 	void *env_pgfault_upcall;	// page fault upcall entry point
@@ -56,6 +91,11 @@ struct Env {
 	uint32_t env_ipc_value;		// data value sent to us 
 	envid_t env_ipc_from;		// envid of the sender	
 	int env_ipc_perm;		// perm of page mapping received
-};
+
+	// Swapping
+	int32_t env_swap_slot;		// swap slot waited for, or -1
+	uint32_t env_swapins;		// pages faulted back in
+	uint32_t env_swapouts;		// pages taken away
+} __attribute__((aligned(ENV_ALIGN)));
 
 #endif // !JOS_INC_ENV_H
@@ -44,6 +44,9 @@ int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int priority);
+int	sys_env_set_tickets(envid_t env, int tickets);
+int	sys_env_set_affinity(envid_t env, uint32_t mask);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
@@ -52,6 +55,17 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+envid_t	sys_fork(void);
+int	sys_page_batch(struct Page_op *ops, int n);
+int	sys_swap_register(uint32_t nslots);
+int	sys_swap_out(void *va);
+int	sys_swap_in(void *va);
+int	sys_swap_done(uint32_t slot);
+int	sys_shm_open(const char *name, uint32_t npages, int flags);
+int	sys_shm_attach(int shmid, void *va, int perm);
+int	sys_shm_detach(int shmid, void *va);
+int	sys_shm_remove(int shmid);
+int	sys_time(uint64_t *ns);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t sys_exofork(void) __attribute__((always_inline));
@@ -67,12 +81,14 @@ sys_exofork(void)
 	return ret;
 }
 
+// time.c
+uint64_t time_ns(void);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -1,7 +1,12 @@
 #ifndef JOS_INC_MALLOC_H
 #define JOS_INC_MALLOC_H 1
 
+#include <inc/types.h>
+
 void *malloc(size_t size);
 void free(void *addr);
 
+// Move the end of the heap (see UHEAP in inc/memlayout.h)
+void *sbrk(intptr_t increment);
+
 #endif
@@ -17,13 +17,17 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS    0x28     // Task segment selector
+#define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
  * Virtual memory map:                                Permissions
  *                                                    kernel/user
  *
  *    4 Gig -------->  +------------------------------+
+ *                     |   Temporary Kernel Mappings  | RW/--  PTSIZE
+ *    KMAPBASE ----->  +------------------------------+ 0xffc00000
+ *                     |   Memory-mapped I/O          | RW/--  PTSIZE
+ *    MMIOBASE ----->  +------------------------------+ 0xff800000
  *                     |                              | RW/--
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *                     :              .               :
@@ -36,14 +40,23 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     :              .               :                   |
  *    ULIM     ------> +------------------------------+ 0xef800000      --+
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *                     |           RO CLOCK           | R-/R-  PGSIZE
+ *    UCLOCK    ---->  | - - - - - - - - - - - - - - -| 0xeefff000
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
@@ -59,7 +72,11 @@
  *                     .                              .
  *                     .                              .
  *                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
- *                     |     Program Data & Heap      |
+ *    UHEAPTOP ----->  +------------------------------+ 0x10000000
+ *                     |     User Heap (see sbrk)     | RW/RW
+ *    UHEAP -------->  +------------------------------+ 0x08000000
+ *                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
+ *                     |     Program Text & Data      |
  *    UTEXT -------->  +------------------------------+ 0x00800000
  *    PFTEMP ------->  |       Empty Memory (*)       |        PTSIZE
  *                     |                              |
@@ -78,15 +95,35 @@
  */
 
 
-// All physical memory mapped at this address
+// Physical memory is mapped at this address, up to MMIOBASE ("lowmem").
 #define	KERNBASE	0xF0000000
 
+// Memory-mapped I/O registers (the local APIC) are mapped in this
+// region, just below the kmap() window; see mmio_map_region().
+#define MMIOBASE	(KMAPBASE - PTSIZE)
+#define MMIOLIM		KMAPBASE
+
+// Physical pages above that ("highmem") are only mapped into the kernel
+// on demand, one page at a time, in this window at the top of the
+// address space; see kmap() in kern/pmap.c.
+#define KMAPBASE	0xFFC00000
+
 // At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
 // IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
 // at physical address EXTPHYSMEM.
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// The boot loader leaves the BIOS's E820 physical memory map here: a
+// uint32_t count, followed by up to E820_MAX struct E820_entry.
+#define E820MAP		0x8000
+#define E820_MAX	32
+#define E820_RAM	1	// entry type of usable memory
+
+// Application processors start in real mode at this address, where
+// boot_aps() copies the code of kern/mpentry.S.
+#define MPENTRY_PADDR	0x7000
+
 // Virtual page table.  Entry PDX[VPT] in the PD contains a pointer to
 // the page directory itself, thereby turning the PD into a page table,
 // which maps all the PTEs containing the page mappings for the entire
@@ -94,6 +131,7 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
+#define KSTKGAP		(8*PGSIZE)		// guard below each CPU's stack
 #define ULIM		(KSTACKTOP - PTSIZE) 
 
 /*
@@ -107,6 +145,9 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// The clock page (struct Clock, inc/clock.h), in the last page of the
+// UENVS window, which envs[] doesn't reach
+#define UCLOCK		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -125,6 +166,11 @@
 
 // Used for temporary page mappings.  Typed 'void*' for convenience
 #define UTEMP		((void*) PTSIZE)
+
+// The user heap: sbrk() moves the program break up from UHEAP, but
+// never past UHEAPTOP.
+#define UHEAP		0x08000000
+#define UHEAPTOP	0x10000000
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
@@ -163,11 +209,29 @@ extern volatile pde_t vpd[];     // VA of current page directory
  * You can map a Page * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
  */
-LIST_HEAD(Page_list, Page);
-typedef LIST_ENTRY(Page) Page_LIST_entry_t;
+
+// Lists of pages are linked by page number instead of by pointer, to
+// keep struct Page small; see the page_list_*() functions in
+// kern/pmap.h.  PP_NIL ends a list.
+#define PP_NIL		0xFFFFFFFF
+
+struct Page_list {
+	uint32_t pl_first;		// page number of the first page
+};
 
 struct Page {
-	Page_LIST_entry_t pp_link;	/* free list link */
+	union {
+		// While the page is on a free list
+		struct {
+			uint32_t pl_next;	// page numbers, or PP_NIL
+			uint32_t pl_prev;
+		} pp_link;
+
+		// For a page used as a user page table: how many of its
+		// entries are in use.  The table is freed when this drops
+		// back to 0.
+		uint16_t pp_nvalid;
+	};
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -175,7 +239,31 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator bookkeeping.  While PP_FREE is set, this page
+	// heads a free block of 2^pp_order pages.  For an allocated block,
+	// pp_order of its first page is the order it was allocated with.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+/*
+ * One range of the E820 physical memory map (see E820MAP).
+ */
+struct E820_entry {
+	uint64_t e_addr;
+	uint64_t e_len;
+	uint32_t e_type;
+} __attribute__((packed));
+
+// Values of pp_flags in struct Page
+#define PP_FREE		0x01	// heads a block on a buddy free list
+#define PP_PINNED	0x02	// never freed; pp_ref stays PP_REF_PINNED
+
+// The pp_ref of a pinned page.  Mapping and unmapping the page leave it
+// alone, so it can't wrap around however often the page is mapped, and
+// the page always looks shared.
+#define PP_REF_PINNED	0xFFFF
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -65,18 +65,38 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global
 #define PTE_MBZ		0x180	// Bits must be zero
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+// Passed to sys_page_alloc, it asks for a demand-zero page instead.
+#define PTE_COW		0x800
+
+// PTE_SHARE marks pages that fork and spawn share with the child
+// instead of copying.  Also one of the PTE_AVAIL bits.
+#define PTE_SHARE	0x400
+
+// A PTE that is not present but has PTE_SWAP set stands for a page the
+// kernel swapped out (see kern/swap.h).  The address bits give the swap
+// slot, the PTE_USER bits the permissions the page had.
+#define PTE_SWAP	0x200
+#define PTE_SWAPSLOT(pte)	(((uint32_t) (pte)) >> PGSHIFT)
+
 // Only flags in PTE_USER may be used in system calls.
 #define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// CPUID function 1 feature flags (in %edx)
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+#define CPUID_PGE	0x00002000	// Page Global Enable
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -91,6 +111,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
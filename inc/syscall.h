@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum
 {
@@ -18,7 +20,50 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_fork,
+	SYS_page_batch,
+	SYS_swap_register,
+	SYS_swap_out,
+	SYS_swap_in,
+	SYS_swap_done,
+	SYS_shm_open,
+	SYS_shm_attach,
+	SYS_shm_detach,
+	SYS_shm_remove,
+	SYS_env_set_priority,
+	SYS_env_set_tickets,
+	SYS_env_set_affinity,
+	SYS_time,
 	NSYSCALLS
 };
 
+// One operation for SYS_page_batch.  Each works like the single-page
+// system call of the same name, with the same errors.
+enum {
+	PGOP_ALLOC = 1,		// sys_page_alloc(dstenv, dstva, perm)
+	PGOP_MAP,		// sys_page_map(srcenv, srcva, dstenv, dstva, perm)
+	PGOP_UNMAP,		// sys_page_unmap(dstenv, dstva)
+	PGOP_PROTECT,		// change the perm of the page at dstenv/dstva
+	PGOP_ALLOC_ZERO,	// like PGOP_ALLOC, but a demand-zero page: the
+				// frame is only allocated on the first write
+};
+
+struct Page_op {
+	int op;			// PGOP_*
+	int32_t srcenv;		// envid, PGOP_MAP only
+	void *srcva;		// PGOP_MAP only
+	int32_t dstenv;		// envid of the address space to change
+	void *dstva;
+	int perm;
+	int result;		// set by the kernel: 0 or -E_*
+};
+
+// Most operations one SYS_page_batch call takes.
+#define PGOP_MAX	1024
+
+// Named shared memory regions (SYS_shm_*)
+#define SHM_NAMELEN	32		// including the terminating NUL
+#define SHM_MAXPAGES	1024		// largest region, in pages
+#define SHM_CREATE	0x1		// sys_shm_open: create if missing
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -35,6 +35,8 @@
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
+#define IRQ_WAKEUP      17	// IPI that wakes up a halted CPU, or
+				// brings one in user mode into the kernel
 #define IRQ_ERROR       19
 
 #ifndef __ASSEMBLER__
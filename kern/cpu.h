@@ -0,0 +1,62 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Maximum number of CPUs
+#define NCPU	8
+
+// Values of cpu_status in struct Cpu
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+// Per-CPU state
+struct Cpu {
+	uint8_t cpu_id;			// Local APIC ID; index into cpus[]
+	volatile unsigned cpu_status;	// The status of the CPU
+	struct Env *cpu_env;		// The currently-running environment
+	uint64_t cpu_tsc;		// TSC at the last env_run() here
+	uint32_t cpu_lapic_count;	// LAPIC timer count per tick, or 0
+	uint64_t cpu_boot_tsc;		// TSC when the CPU came up
+	uint64_t cpu_idle_tsc;		// TSC when it last halted
+	uint64_t cpu_idle_cycles;	// TSC cycles spent halted
+	uint32_t cpu_nhalt;		// times it halted
+	volatile uint32_t cpu_tlb_flush; // set when another CPU wants the TLB flushed
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+};
+
+// Initialized in mpconfig.c
+extern struct Cpu cpus[NCPU];
+extern int ncpu;			// Total number of CPUs in the system
+extern struct Cpu *bootcpu;		// The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;		// Physical MMIO address of the local APIC
+extern physaddr_t ioapicaddr;		// Physical MMIO address of the I/O APIC, or 0
+extern uint8_t ioapicid;		// I/O APIC ID
+extern uint8_t isa_irq_pin[];		// I/O APIC pin of each ISA IRQ
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+int cpunum(void);
+#define thiscpu (&cpus[cpunum()])
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_eoi(void);
+void lapic_ipi(int apicid, int vector);
+void lapic_timer_idle(uint32_t ticks);
+void lapic_timer_resume(void);
+
+#endif	// !JOS_KERN_CPU_H
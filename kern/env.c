@@ -12,9 +12,10 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/spinlock.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
 static struct Env_list env_free_list;	// Free list
 
 #define ENVGENSHIFT	12		// >= LOGNENV
@@ -44,9 +45,11 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// then check the env_id field in that struct Env
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
-	// that used the same slot in the envs[] array).
+	// that used the same slot in the envs[] array).  An environment
+	// that is only waiting for its CPU to free it is gone already.
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -102,7 +105,7 @@ env_setup_vm(struct Env *e)
 	struct Page *p = NULL;
 
 	// Allocate a page for the page directory
-	if ((r = page_alloc(&p)) < 0)
+	if ((r = page_alloc_zero(&p)) < 0)
 		return r;
 
 	// Now, set e->env_pgdir and e->env_cr3,
@@ -126,7 +129,6 @@ env_setup_vm(struct Env *e)
 	// LAB 3:
 	e->env_pgdir = page2kva(p);
 	e->env_cr3 = PADDR(e->env_pgdir);
-	memset(e->env_pgdir, 0, PGSIZE);
 	p->pp_ref++;
 
 	// Using the boot_pgdir as a template to initialize the pgdir element.
@@ -172,7 +174,28 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
+	// Children run at the priority, with the tickets and on the CPUs
+	// of their parent, and the file server ahead of its clients.
+	if (parent_id && curenv) {
+		e->env_priority = curenv->env_priority;
+		e->env_tickets = curenv->env_tickets;
+		e->env_affinity = curenv->env_affinity;
+	} else {
+		e->env_priority = ENV_PRIO_DEFAULT;
+		e->env_tickets = ENV_TICKETS_DEFAULT;
+		e->env_affinity = ENV_AFFINITY_ALL;
+	}
+	if (e == &envs[1])
+		e->env_priority = ENV_PRIO_HIGH;
+	e->env_pass = 0;
+	e->env_cycles = 0;
+	e->env_cpunum = -1;
+	// New environments start on the creating CPU's run queue.
+	e->env_rqcpu = cpunum();
+	e->env_migrations = 0;
+	e->env_level = MLFQ_NLEVEL - 1;
+	e->env_ticks = 0;
+	env_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -203,8 +226,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	e->env_swap_slot = -1;
+	e->env_swapins = 0;
+	e->env_swapouts = 0;
+
 	// If this is the file server (e == &envs[1]) give it I/O privileges.
 	// LAB 5: Your code here.
+	if (e == &envs[1])
+		e->env_tf.tf_eflags |= FL_IOPL_3;
 
 	// commit the allocation
 	LIST_REMOVE(e, env_link);
@@ -217,7 +246,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
-// Does not zero or otherwise initialize the mapped pages in any way.
+// The pages come from page_alloc_high_zero(), so they start out zeroed.
 // Pages should be writable by user and kernel.
 // Panic if any allocation attempt fails.
 //
@@ -233,14 +262,15 @@ segment_alloc(struct Env *e, void *va, size_t len)
 	// TODO: Check why this has changed from "len" to "va + len"
 	//   You should round va down, and round (va + len) up.
 	struct Page *ppage;
+	uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
 
-	int i;
-	for (i = 0;i < ROUNDUP(len, PGSIZE); i += PGSIZE) {
-		if (page_alloc(&ppage) == -E_NO_MEM) {
+	for (; a < end; a += PGSIZE) {
+		if (page_alloc_high_zero(&ppage) == -E_NO_MEM) {
 			panic("Segment alloc failed: No memory");
 		}
 		int error;
-		error = page_insert(e->env_pgdir, ppage, ROUNDDOWN(va, PGSIZE)+i, 
+		error = page_insert(e->env_pgdir, ppage, (void *) a, 
 				PTE_U | PTE_W | PTE_P);
 		if (error != 0) {
 			panic("Segment alloc faild: %e", error);
@@ -248,6 +278,25 @@ segment_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Like segment_alloc, but maps the pages demand-zero: no memory is
+// used until the environment first writes to a page.
+//
+static void
+segment_alloc_zero(struct Env *e, void *va, size_t len)
+{
+	uintptr_t a = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+	int error;
+
+	for (; a < end; a += PGSIZE) {
+		error = page_map_zero(e->env_pgdir, (void *) a,
+				PTE_U | PTE_W | PTE_P);
+		if (error != 0)
+			panic("Segment alloc faild: %e", error);
+	}
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -314,10 +363,18 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	while (ph < end_ph) {
 		if (ph->p_type == ELF_PROG_LOAD) {
 
+			// Pages holding file data get real (zeroed) pages; the
+			// pages past them, pure bss, are demand-zero.
 			// Note: segment_alloc will panic if it fails...
-			segment_alloc(e, (void *)ph->p_va, ph->p_memsz);
+			uintptr_t bss = ph->p_va;
+			if (ph->p_filesz > 0) {
+				segment_alloc(e, (void *)ph->p_va, ph->p_filesz);
+				bss = ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE);
+			}
+			if (ph->p_va + ph->p_memsz > bss)
+				segment_alloc_zero(e, (void *)bss,
+					ph->p_va + ph->p_memsz - bss);
 			memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-			memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
 		}
 		ph++;
 		
@@ -329,7 +386,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	// at virtual address USTACKTOP - PGSIZE.
 	// LAB 3:
  	struct Page *user_stack;
-	if (page_alloc(&user_stack) == -E_NO_MEM)
+	if (page_alloc_high_zero(&user_stack) == -E_NO_MEM)
 		panic("load_icode: User stack not allocated. Not enough memory");
 	page_insert(e->env_pgdir, user_stack, (void *)(USTACKTOP - PGSIZE), PTE_U | PTE_W | PTE_P);
 }
@@ -359,8 +416,7 @@ env_create(uint8_t *binary, size_t size)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	uint32_t pdeno;
 	physaddr_t pa;
 	
 	// If freeing the current environment, switch to boot_pgdir
@@ -374,23 +430,17 @@ env_free(struct Env *e)
 
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
+	page_remove_range(e->env_pgdir, 0, UTOP);
+	swap_env_free(e);
+
+	// free the page tables themselves
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
-		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
@@ -402,10 +452,40 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
+	e->env_cpunum = -1;
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
 }
 
+//
+// Change the status of 'e', keeping the scheduler's run queue up to
+// date.  Every change of env_status after env_init() goes through here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+		sched_dequeue(e);
+	else if (e->env_status != ENV_RUNNABLE && status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	e->env_status = status;
+}
+
+//
+// Change the scheduling priority of 'e', moving it to the back of the
+// run queue of its new priority if it is runnable.
+//
+void
+env_set_priority(struct Env *e, uint32_t priority)
+{
+	if (e->env_status == ENV_RUNNABLE) {
+		sched_dequeue(e);
+		e->env_priority = priority;
+		sched_enqueue(e);
+	} else
+		e->env_priority = priority;
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
@@ -414,6 +494,14 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e) 
 {
+	// If e is running on another CPU, it can't be freed from under
+	// that CPU: mark it, and that CPU frees it the next time it
+	// traps into the kernel.
+	if (e->env_cpunum >= 0 && e != curenv) {
+		env_set_status(e, ENV_DYING);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -451,6 +539,8 @@ env_pop_tf(struct Trapframe *tf)
 void
 env_run(struct Env *e)
 {
+	uint64_t now;
+
 	// Step 1: If this is a context switch (a new environment is running),
 	//	   then set 'curenv' to the new environment,
 	//	   update its 'env_runs' counter, and
@@ -466,9 +556,20 @@ env_run(struct Env *e)
 	
 	// LAB 3: 
 	// TODO: Need to check for context switch before `curenv  = e`?
+	// Charge the time since the last env_run() to the environment
+	// that was running.
+	now = read_tsc();
+	if (curenv) {
+		sched_charge(curenv, now - thiscpu->cpu_tsc);
+		curenv->env_cpunum = -1;
+	}
+	thiscpu->cpu_tsc = now;
+
 	curenv  = e;
+	curenv->env_cpunum = cpunum();
 	curenv->env_runs++;
 	lcr3(curenv->env_cr3);
+	unlock_kernel();
 	env_pop_tf(&(e->env_tf));
 }
 
@@ -11,14 +11,19 @@
 #define JOS_MULTIENV 0
 #endif
 
+#include <kern/cpu.h>
+
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;		// Current environment
+#define curenv (thiscpu->cpu_env)	// Current environment
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
+TAILQ_HEAD(Env_tailq, Env);		// Declares 'struct Env_tailq'
 
 void	env_init(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
+void	env_set_status(struct Env *e, unsigned status);
+void	env_set_priority(struct Env *e, uint32_t priority);
 void	env_create(uint8_t *binary, size_t size);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
@@ -7,12 +7,17 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/ksm.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
+static void boot_aps(void);
 
 void
 i386_init(void)
@@ -35,14 +40,32 @@ i386_init(void)
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
 	i386_vm_init();
+	kmem_init();
+	ksm_init();
+
+	// Find the CPUs; needs mmio_map_region() for the local APIC.
+	mp_init();
+	lapic_init();
+	ioapic_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	idt_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
 	kclock_init();
+	// Only the I/O APIC path acknowledges disk interrupts; the 8259A
+	// would need an EOI on the slave.
+	if (ioapicaddr)
+		irq_enable(IRQ_IDE);
+
+	// Acquire the big kernel lock before waking up APs
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	boot_aps();
 
 	// Should always have an idle process as first one.
 	ENV_CREATE(user_idle);
@@ -71,6 +94,66 @@ i386_init(void)
 		monitor(NULL);
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct Cpu *c;
+
+	if (ncpu == 1)
+		return;
+
+	// mpentry.S runs at its physical address until it jumps to
+	// mp_main(): map the low 4MB while the APs come up, as
+	// i386_vm_init() did for the boot CPU.
+	boot_pgdir[0] = boot_pgdir[PDX(KERNBASE)] & ~PTE_G;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+
+	boot_pgdir[0] = 0;
+	lcr3(boot_cr3);
+	cprintf("SMP: %d CPUs started\n", ncpu);
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	pmap_init_percpu();
+	lapic_init();
+	trap_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, call sched_yield()
+	// to start running processes on this CPU.  But make sure that
+	// only one CPU can enter the scheduler at a time!
+	lock_kernel();
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -0,0 +1,96 @@
+// The I/O APIC manages hardware interrupts for an SMP system.
+// http://www.intel.com/design/chipsets/datashts/29056601.pdf
+// See also picirq.c.
+
+#include <inc/types.h>
+#include <inc/stdio.h>
+#include <inc/trap.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+
+#define REG_ID     0x00  // Register index: ID
+#define REG_VER    0x01  // Register index: version
+#define REG_TABLE  0x10  // Redirection table base
+
+// The redirection table starts at REG_TABLE and uses
+// two registers to configure each interrupt.
+// The first (low) register in a pair contains configuration bits.
+// The second (high) register contains a bitmask telling which
+// CPUs can serve that interrupt.
+#define INT_DISABLED   0x00010000  // Interrupt disabled
+#define INT_LEVEL      0x00008000  // Level-triggered (vs edge-)
+#define INT_ACTIVELOW  0x00002000  // Active low (vs high)
+#define INT_LOGICAL    0x00000800  // Destination is CPU id (vs APIC ID)
+
+// IO APIC MMIO structure: write reg, then read or write data.
+struct ioapic {
+	uint32_t reg;
+	uint32_t pad[3];
+	uint32_t data;
+};
+
+volatile struct ioapic *ioapic;  // Initialized in ioapic_init()
+
+static uint32_t
+ioapic_read(int reg)
+{
+	ioapic->reg = reg;
+	return ioapic->data;
+}
+
+static void
+ioapic_write(int reg, uint32_t data)
+{
+	ioapic->reg = reg;
+	ioapic->data = data;
+}
+
+//
+// Map the I/O APIC that mp_init() found, if any, and mask all of its
+// interrupts.  Without one, interrupts keep going through the 8259A.
+//
+void
+ioapic_init(void)
+{
+	int i, maxintr;
+
+	if (!ioapicaddr)
+		return;
+
+	ioapic = mmio_map_region(ioapicaddr, PGSIZE);
+	maxintr = (ioapic_read(REG_VER) >> 16) & 0xFF;
+	if (((ioapic_read(REG_ID) >> 24) & 0x0F) != ioapicid)
+		cprintf("ioapic_init: id isn't equal to ioapicid; not a MP\n");
+
+	// Mark all interrupts edge-triggered, active high, disabled,
+	// and not routed to any CPUs.
+	for (i = 0; i <= maxintr; i++) {
+		ioapic_write(REG_TABLE + 2 * i, INT_DISABLED | (IRQ_OFFSET + i));
+		ioapic_write(REG_TABLE + 2 * i + 1, 0);
+	}
+}
+
+//
+// Route ISA interrupt 'irq' to the CPU whose local APIC ID is
+// 'apicid', as an edge-triggered, active-high interrupt with vector
+// IRQ_OFFSET + irq.
+//
+void
+ioapic_enable(int irq, int apicid)
+{
+	int pin = isa_irq_pin[irq];
+
+	ioapic_write(REG_TABLE + 2 * pin, IRQ_OFFSET + irq);
+	ioapic_write(REG_TABLE + 2 * pin + 1, apicid << 24);
+}
+
+// Mask ISA interrupt 'irq' again.
+void
+ioapic_disable(int irq)
+{
+	int pin = isa_irq_pin[irq];
+
+	ioapic_write(REG_TABLE + 2 * pin, INT_DISABLED | (IRQ_OFFSET + irq));
+}
@@ -2,17 +2,34 @@
 
 /* Support for two time-related hardware gadgets: 1) the run time
  * clock with its NVRAM access functions; 2) the 8253 timer, which
- * generates interrupts on IRQ 0.
+ * generates interrupts on IRQ 0, and against which the TSC is
+ * calibrated for the nanosecond clock.
  */
 
 #include <inc/x86.h>
 #include <inc/stdio.h>
 #include <inc/isareg.h>
 #include <inc/timerreg.h>
+#include <inc/trap.h>
+#include <inc/clock.h>
 
 #include <kern/kclock.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
 
+// System control port B: the gate and output of 8253 counter 2
+#define IO_PORTB	0x61
+#define 	PORTB_GATE2	0x01	// counter 2 gate
+#define 	PORTB_SPKR	0x02	// speaker data
+#define 	PORTB_OUT2	0x20	// counter 2 output
+
+// The TSC is timed over 1/TSC_CALIBRATE_HZ s: as long as the 8253's
+// 16-bit counter allows, for precision.
+#define TSC_CALIBRATE_HZ	20
+
+// The clock page, mapped read-only at UCLOCK for user environments.
+// It fills a page of its own, so no other kernel data shows through.
+union Clock_page uclock __attribute__((aligned(PGSIZE)));
 
 unsigned
 mc146818_read(unsigned reg)
@@ -29,15 +46,70 @@ mc146818_write(unsigned reg, unsigned datum)
 }
 
 
+//
+// Use 8253 counter 2, which nothing else uses, as a stopwatch: start it
+// counting down 'latch' ticks of TIMER_FREQ.  pit_expired() says when
+// they have passed.
+//
+void
+pit_oneshot(uint16_t latch)
+{
+	// Gate counter 2 on, with the speaker off.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~PORTB_SPKR) | PORTB_GATE2);
+	// Mode 0: OUT2 goes high once 'latch' ticks have passed.
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_INTTC | TIMER_16BIT);
+	outb(TIMER_CNTR2, latch % 256);
+	outb(TIMER_CNTR2, latch / 256);
+}
+
+bool
+pit_expired(void)
+{
+	return (inb(IO_PORTB) & PORTB_OUT2) != 0;
+}
+
+//
+// Time the TSC against the 8253 and fill in the clock page.  Time 0 is
+// now.
+//
+static void
+tsc_calibrate(void)
+{
+	struct Clock *ck = &uclock.ck;
+	uint64_t t0, t1;
+
+	pit_oneshot(TIMER_DIV(TSC_CALIBRATE_HZ));
+	t0 = read_tsc();
+	while (!pit_expired())
+		;
+	t1 = read_tsc();
+
+	ck->ck_tsc_freq = (t1 - t0) * TSC_CALIBRATE_HZ;
+	ck->ck_mult = (1000000000ULL << CLOCK_SHIFT) / ck->ck_tsc_freq;
+	ck->ck_tsc_base = t0;
+}
+
+// Nanoseconds since boot.
+uint64_t
+clock_ns(void)
+{
+	return clock_tsc2ns(&uclock.ck, read_tsc());
+}
+
 void
 kclock_init(void)
 {
-	/* initialize 8253 clock to interrupt 100 times/sec */
+	tsc_calibrate();
+	cprintf("	TSC runs at %u kHz\n",
+		(uint32_t) (uclock.ck.ck_tsc_freq / 1000));
+
+	/* initialize 8253 clock to interrupt TIMER_HZ times/sec */
 	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
-	outb(IO_TIMER1, TIMER_DIV(100) % 256);
-	outb(IO_TIMER1, TIMER_DIV(100) / 256);
-	cprintf("	Setup timer interrupts via 8259A\n");
-	irq_setmask_8259A(irq_mask_8259A & ~(1<<0));
+	outb(IO_TIMER1, TIMER_DIV(TIMER_HZ) % 256);
+	outb(IO_TIMER1, TIMER_DIV(TIMER_HZ) / 256);
+	cprintf("	Setup timer interrupts via %s\n",
+		ioapicaddr ? "I/O APIC" : "8259A");
+	irq_enable(IRQ_TIMER);
 	cprintf("	unmasked timer interrupt\n");
 }
 
@@ -8,6 +8,8 @@
 
 #define	IO_RTC		0x070		/* RTC port */
 
+#define	TIMER_HZ	100		/* timer interrupts per second */
+
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50	/* 50 bytes of NVRAM */
 
@@ -26,8 +28,22 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)	/* RTC offset 0x32 */
 
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/clock.h>
+
+union Clock_page {
+	struct Clock ck;
+	char ck_pad[PGSIZE];
+};
+
+extern union Clock_page uclock;
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 void kclock_init(void);
+void pit_oneshot(uint16_t latch);
+bool pit_expired(void);
+uint64_t clock_ns(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
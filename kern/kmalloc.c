@@ -0,0 +1,406 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+// Objects start this far into the slab page, and the header never
+// overlaps them.  Since the header is at offset 0, no slab object is
+// ever page-aligned, which is how kfree() tells small objects from
+// whole-page allocations.
+#define KMEM_ALIGN	16
+#define SLAB_HDRSIZE	ROUNDUP(sizeof(struct Slab), KMEM_ALIGN)
+
+// Free objects are chained through a pointer stored kc_linkoff bytes
+// into the object.  For caches without a constructor this is simply
+// the first word; caches with a constructor get an extra word past the
+// end of each object, so that free objects keep their constructed state.
+#define SLAB_LINK(cp, obj)	(*(void **) ((char *) (obj) + (cp)->kc_linkoff))
+
+// The cache from which all other caches are allocated.
+static struct Kmem_cache cache_cache;
+
+// Every cache, for the monitor.
+static struct Kmem_cache_list kmem_caches;
+
+// Size-class caches backing kmalloc().
+static struct Kmem_cache *kmalloc_caches[KMEM_NCLASS];
+
+// Pages handed out by kmalloc() for requests above KMEM_MAXCLASS.
+static uint32_t kmem_large_pages;
+
+static void check_kmem(void);
+
+//
+// Fill in a cache descriptor for objects of 'size' bytes.
+// Returns 0 on success, -E_INVAL if an object doesn't fit in a slab.
+//
+static int
+kmem_cache_setup(struct Kmem_cache *cp, const char *name, size_t size,
+		 void (*ctor)(void *))
+{
+	size_t slot;
+
+	if (size == 0)
+		return -E_INVAL;
+	size = ROUNDUP(size, sizeof(void *));
+	if (ctor) {
+		cp->kc_linkoff = size;
+		slot = size + sizeof(void *);
+	} else {
+		cp->kc_linkoff = 0;
+		slot = size;
+	}
+	if (slot > PGSIZE - SLAB_HDRSIZE)
+		return -E_INVAL;
+
+	memset(cp->kc_name, 0, sizeof(cp->kc_name));
+	strncpy(cp->kc_name, name, sizeof(cp->kc_name) - 1);
+	cp->kc_objsize = size;
+	cp->kc_size = slot;
+	cp->kc_ctor = ctor;
+	cp->kc_perslab = (PGSIZE - SLAB_HDRSIZE) / slot;
+	LIST_INIT(&cp->kc_empty);
+	LIST_INIT(&cp->kc_partial);
+	LIST_INIT(&cp->kc_full);
+	cp->kc_nslabs = 0;
+	cp->kc_inuse = 0;
+	cp->kc_nalloc = 0;
+	LIST_INSERT_HEAD(&kmem_caches, cp, kc_link);
+	return 0;
+}
+
+//
+// Get a fresh page from the page allocator, carve it into objects,
+// run the constructor on each and put the slab on cp's empty list.
+// Returns NULL if out of memory.
+//
+static struct Slab *
+slab_grow(struct Kmem_cache *cp)
+{
+	struct Page *pp;
+	struct Slab *s;
+	char *obj;
+	int i;
+
+	if (page_alloc(&pp) < 0)
+		return NULL;
+
+	s = page2kva(pp);
+	s->sl_cache = cp;
+	s->sl_inuse = 0;
+	s->sl_total = cp->kc_perslab;
+	s->sl_free = NULL;
+
+	// Chain the objects so that they are handed out in address order.
+	obj = (char *) s + SLAB_HDRSIZE + (s->sl_total - 1) * cp->kc_size;
+	for (i = 0; i < s->sl_total; i++, obj -= cp->kc_size) {
+		if (cp->kc_ctor)
+			cp->kc_ctor(obj);
+		SLAB_LINK(cp, obj) = s->sl_free;
+		s->sl_free = obj;
+	}
+
+	LIST_INSERT_HEAD(&cp->kc_empty, s, sl_link);
+	cp->kc_nslabs++;
+	return s;
+}
+
+//
+// Give an unused slab's page back to the page allocator.
+//
+static void
+slab_release(struct Slab *s)
+{
+	struct Kmem_cache *cp = s->sl_cache;
+
+	assert(s->sl_inuse == 0);
+	LIST_REMOVE(s, sl_link);
+	cp->kc_nslabs--;
+	page_free(pa2page(PADDR(s)));
+}
+
+//
+// Create a cache of objects of 'size' bytes.  If 'ctor' is not NULL it
+// is run once on every object when its slab is created; objects are
+// expected to be returned to the cache in their constructed state.
+// Returns NULL if out of memory or if 'size' is too big for a slab.
+//
+struct Kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *))
+{
+	struct Kmem_cache *cp;
+
+	if ((cp = kmem_cache_alloc(&cache_cache)) == NULL)
+		return NULL;
+	if (kmem_cache_setup(cp, name, size, ctor) < 0) {
+		kmem_cache_free(&cache_cache, cp);
+		return NULL;
+	}
+	return cp;
+}
+
+//
+// Destroy a cache created with kmem_cache_create().
+// All of its objects must have been freed.
+//
+void
+kmem_cache_destroy(struct Kmem_cache *cp)
+{
+	if (cp->kc_inuse != 0)
+		panic("kmem_cache_destroy: %s still has %d objects in use",
+		      cp->kc_name, cp->kc_inuse);
+	while (!LIST_EMPTY(&cp->kc_empty))
+		slab_release(LIST_FIRST(&cp->kc_empty));
+	LIST_REMOVE(cp, kc_link);
+	kmem_cache_free(&cache_cache, cp);
+}
+
+//
+// Allocate an object from cache 'cp'.
+// Partially used slabs are preferred over empty ones, to keep the
+// number of pages the cache holds on to small.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct Kmem_cache *cp)
+{
+	struct Slab *s;
+	void *obj;
+
+	if ((s = LIST_FIRST(&cp->kc_partial)) == NULL) {
+		if ((s = LIST_FIRST(&cp->kc_empty)) == NULL
+		    && (s = slab_grow(cp)) == NULL)
+			return NULL;
+		LIST_REMOVE(s, sl_link);
+		LIST_INSERT_HEAD(&cp->kc_partial, s, sl_link);
+	}
+
+	obj = s->sl_free;
+	s->sl_free = SLAB_LINK(cp, obj);
+	if (++s->sl_inuse == s->sl_total) {
+		LIST_REMOVE(s, sl_link);
+		LIST_INSERT_HEAD(&cp->kc_full, s, sl_link);
+	}
+
+	cp->kc_inuse++;
+	cp->kc_nalloc++;
+	return obj;
+}
+
+//
+// Return an object to cache 'cp'.
+// A cache keeps at most one empty slab around; further slabs that
+// become empty are given back to the page allocator.
+//
+void
+kmem_cache_free(struct Kmem_cache *cp, void *obj)
+{
+	struct Slab *s = ROUNDDOWN(obj, PGSIZE);
+
+	if (s->sl_cache != cp || s->sl_inuse == 0)
+		panic("kmem_cache_free: %08x is not a %s object", obj, cp->kc_name);
+
+	if (s->sl_inuse-- == s->sl_total) {
+		LIST_REMOVE(s, sl_link);
+		LIST_INSERT_HEAD(&cp->kc_partial, s, sl_link);
+	}
+	SLAB_LINK(cp, obj) = s->sl_free;
+	s->sl_free = obj;
+	cp->kc_inuse--;
+
+	if (s->sl_inuse == 0) {
+		if (LIST_EMPTY(&cp->kc_empty)) {
+			LIST_REMOVE(s, sl_link);
+			LIST_INSERT_HEAD(&cp->kc_empty, s, sl_link);
+		} else
+			slab_release(s);
+	}
+}
+
+//
+// Allocate 'size' bytes of kernel memory.
+// Requests up to KMEM_MAXCLASS bytes are served from the size-class
+// caches; larger ones get a page-aligned block of 2^n whole pages.
+// Returns NULL if out of memory or if 'size' is bigger than
+// the largest buddy block.
+//
+void *
+kmalloc(size_t size)
+{
+	struct Page *pp;
+	int i;
+
+	if (size == 0)
+		return NULL;
+
+	if (size <= KMEM_MAXCLASS) {
+		for (i = 0; (KMEM_MINCLASS << i) < size; i++)
+			;
+		return kmem_cache_alloc(kmalloc_caches[i]);
+	}
+
+	// Larger than any buddy block
+	if (size > (PGSIZE << BUDDY_MAX_ORDER))
+		return NULL;
+	for (i = 0; (PGSIZE << i) < size; i++)
+		;
+	if (page_alloc_order(&pp, i) < 0)
+		return NULL;
+	kmem_large_pages += 1 << i;
+	return page2kva(pp);
+}
+
+//
+// Free memory returned by kmalloc().
+//
+void
+kfree(void *ptr)
+{
+	struct Page *pp;
+	struct Slab *s;
+
+	if (ptr == NULL)
+		return;
+
+	if (PGOFF(ptr) == 0) {
+		pp = pa2page(PADDR(ptr));
+		kmem_large_pages -= 1 << pp->pp_order;
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	s = ROUNDDOWN(ptr, PGSIZE);
+	kmem_cache_free(s->sl_cache, ptr);
+}
+
+//
+// Set up the cache of caches and the kmalloc() size classes.
+// Must run after the page allocator is up.
+//
+void
+kmem_init(void)
+{
+	char name[KMEM_NAMELEN];
+	int i;
+
+	LIST_INIT(&kmem_caches);
+	if (kmem_cache_setup(&cache_cache, "kmem_cache",
+			     sizeof(struct Kmem_cache), NULL) < 0)
+		panic("kmem_init: cannot set up the cache of caches");
+
+	for (i = 0; i < KMEM_NCLASS; i++) {
+		snprintf(name, sizeof(name), "kmalloc-%d", KMEM_MINCLASS << i);
+		if ((kmalloc_caches[i] = kmem_cache_create(name,
+				KMEM_MINCLASS << i, NULL)) == NULL)
+			panic("kmem_init: cannot create %s", name);
+	}
+
+	check_kmem();
+}
+
+void
+kmem_print_stats(void)
+{
+	struct Kmem_cache *cp;
+
+	cprintf("cache            size perslab  slabs  inuse   total  allocs\n");
+	LIST_FOREACH(cp, &kmem_caches, kc_link)
+		cprintf("%-16s %4d %7d %6d %6d %7d %7d\n", cp->kc_name,
+			cp->kc_objsize, cp->kc_perslab, cp->kc_nslabs,
+			cp->kc_inuse, cp->kc_nslabs * cp->kc_perslab,
+			cp->kc_nalloc);
+	cprintf("large kmalloc pages: %d\n", kmem_large_pages);
+}
+
+#define CHECK_MAGIC	0x51ab51ab
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *) obj = CHECK_MAGIC;
+}
+
+//
+// Check the slab allocator and kmalloc().
+//
+static void
+check_kmem(void)
+{
+	struct Kmem_cache *cp;
+	struct Page *pp;
+	void *p0, *p1, *p2, *objs[300];
+	int i;
+
+	// small requests are rounded up to a size class and
+	// never come back page-aligned
+	assert((p0 = kmalloc(1)) != NULL);
+	assert((p1 = kmalloc(KMEM_MINCLASS + 1)) != NULL);
+	assert((p2 = kmalloc(KMEM_MAXCLASS)) != NULL);
+	assert(p0 != p1 && p1 != p2 && p0 != p2);
+	assert(PGOFF(p0) != 0 && PGOFF(p1) != 0 && PGOFF(p2) != 0);
+	assert(((struct Slab *) ROUNDDOWN(p0, PGSIZE))->sl_cache
+	       == kmalloc_caches[0]);
+	assert(((struct Slab *) ROUNDDOWN(p1, PGSIZE))->sl_cache
+	       == kmalloc_caches[1]);
+	memset(p2, 0xaa, KMEM_MAXCLASS);
+
+	// a freed object is the next one handed out from its class
+	kfree(p1);
+	assert(kmalloc(2 * KMEM_MINCLASS) == p1);
+	kfree(p0);
+	kfree(p1);
+	kfree(p2);
+
+	// spill over into a second slab, and give them back
+	cp = kmalloc_caches[0];
+	assert(cp->kc_perslab < 300);
+	for (i = 0; i < 300; i++) {
+		assert((objs[i] = kmalloc(KMEM_MINCLASS)) != NULL);
+		memset(objs[i], i, KMEM_MINCLASS);
+	}
+	assert(cp->kc_nslabs == 2);
+	for (i = 0; i < 300; i++) {
+		assert(*(uint8_t *) objs[i] == (uint8_t) i);
+		kfree(objs[i]);
+	}
+	assert(cp->kc_nslabs == 1);
+	assert(LIST_EMPTY(&cp->kc_full));
+
+	// constructed state survives a free/alloc cycle
+	assert((cp = kmem_cache_create("check", 40, check_ctor)) != NULL);
+	assert((p0 = kmem_cache_alloc(cp)) != NULL);
+	assert(*(uint32_t *) p0 == CHECK_MAGIC);
+	kmem_cache_free(cp, p0);
+	assert(kmem_cache_alloc(cp) == p0);
+	assert(*(uint32_t *) p0 == CHECK_MAGIC);
+	kmem_cache_free(cp, p0);
+	kmem_cache_destroy(cp);
+	assert(kmem_cache_create("too-big", PGSIZE, NULL) == NULL);
+
+	// every size class packs more than one object into a slab
+	assert(kmalloc_caches[KMEM_NCLASS - 1]->kc_perslab > 1);
+
+	// large requests get whole, aligned pages
+	assert((p0 = kmalloc(KMEM_MAXCLASS + 1)) != NULL);
+	assert(PGOFF(p0) == 0 && kmem_large_pages == 1);
+	kfree(p0);
+	assert((p0 = kmalloc(3 * PGSIZE)) != NULL);
+	assert(PGOFF(p0) == 0);
+	pp = pa2page(PADDR(p0));
+	assert(pp->pp_order == 2 && page2ppn(pp) % 4 == 0);
+	assert(kmem_large_pages == 4);
+	kfree(p0);
+	assert(kmem_large_pages == 0);
+
+	// requests bigger than the largest buddy block fail
+	assert(kmalloc((PGSIZE << BUDDY_MAX_ORDER) + 1) == NULL);
+	assert(kmalloc(0x80000001) == NULL);
+	assert(kmem_large_pages == 0);
+
+	cprintf("check_kmem() succeeded!\n");
+}
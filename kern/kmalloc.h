@@ -0,0 +1,71 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+// Kernel object allocator.
+//
+// Objects of one size are carved out of single-page slabs, each slab
+// starting with a struct Slab header.  A cache keeps its slabs on three
+// lists by fill level, so both allocation and free are O(1).
+// kmalloc() rounds a request up to one of the power-of-two size-class
+// caches; anything larger than KMEM_MAXCLASS comes straight from the
+// buddy page allocator.  (A 2048-byte class would fit only one object
+// next to the slab header, so it would cost a page per object anyway.)
+
+#define KMEM_MINCLASS	16
+#define KMEM_MAXCLASS	1024
+#define KMEM_NCLASS	7		// 16, 32, ..., 1024
+#define KMEM_NAMELEN	16
+
+struct Kmem_cache;
+LIST_HEAD(Slab_list, Slab);
+LIST_HEAD(Kmem_cache_list, Kmem_cache);
+
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// cache's empty/partial/full list
+	struct Kmem_cache *sl_cache;	// cache this slab belongs to
+	void *sl_free;			// first free object in this slab
+	uint16_t sl_inuse;		// objects handed out
+	uint16_t sl_total;		// objects in this slab
+};
+
+struct Kmem_cache {
+	LIST_ENTRY(Kmem_cache) kc_link;	// list of all caches
+	char kc_name[KMEM_NAMELEN];
+	size_t kc_objsize;		// object size, rounded for alignment
+	size_t kc_size;			// slot size: object plus free link
+	size_t kc_linkoff;		// offset of free link in a slot
+	void (*kc_ctor)(void *);	// run once on each new object
+	uint16_t kc_perslab;		// objects per slab
+
+	struct Slab_list kc_empty;
+	struct Slab_list kc_partial;
+	struct Slab_list kc_full;
+
+	// Usage statistics for the monitor
+	uint32_t kc_nslabs;		// slabs currently held
+	uint32_t kc_inuse;		// objects currently allocated
+	uint32_t kc_nalloc;		// total allocations ever
+};
+
+void	kmem_init(void);
+
+struct Kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *));
+void	kmem_cache_destroy(struct Kmem_cache *cp);
+void	*kmem_cache_alloc(struct Kmem_cache *cp);
+void	kmem_cache_free(struct Kmem_cache *cp, void *obj);
+
+void	*kmalloc(size_t size);
+void	kfree(void *ptr);
+
+void	kmem_print_stats(void);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -0,0 +1,325 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+
+// 32-bit FNV-1a, a word at a time
+#define FNV_OFFSET	2166136261u
+#define FNV_PRIME	16777619u
+
+#define KSM_BUCKET(h)	((h) % KSM_NHASH)
+
+static struct Ksm_frame_list ksm_stable[KSM_NHASH];
+static struct Ksm_item_list ksm_unstable[KSM_NHASH];
+static struct Kmem_cache *ksm_frame_cache;
+static struct Kmem_cache *ksm_item_cache;
+static uint32_t ksm_nitems;	// unstable entries
+static uint32_t ksm_zero_hash;	// hash of a page of zeros
+
+// The cursor: the next page to look at
+static uint32_t ksm_env;
+static uintptr_t ksm_va;
+
+// Statistics for the monitor
+static uint32_t ksm_nmerged;	// pages merged into a stable frame
+static uint32_t ksm_nzero;	// pages merged into the zero page
+static uint32_t ksm_npasses;	// passes over all environments
+
+void
+ksm_init(void)
+{
+	int i;
+
+	for (i = 0; i < KSM_NHASH; i++) {
+		LIST_INIT(&ksm_stable[i]);
+		LIST_INIT(&ksm_unstable[i]);
+	}
+	ksm_frame_cache = kmem_cache_create("ksm_frame",
+					    sizeof(struct Ksm_frame), NULL);
+	ksm_item_cache = kmem_cache_create("ksm_item",
+					   sizeof(struct Ksm_item), NULL);
+	assert(ksm_frame_cache && ksm_item_cache);
+
+	ksm_zero_hash = FNV_OFFSET;
+	for (i = 0; i < PGSIZE / 4; i++)
+		ksm_zero_hash *= FNV_PRIME;
+}
+
+static uint32_t
+ksm_hash(const void *va)
+{
+	const uint32_t *p = va;
+	uint32_t h = FNV_OFFSET;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return h;
+}
+
+static bool
+ksm_is_zero(const void *va)
+{
+	const uint32_t *p = va;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static bool
+ksm_same(struct Page *a, struct Page *b)
+{
+	void *va = kmap(a), *vb = kmap(b);
+	bool same = memcmp(va, vb, PGSIZE) == 0;
+
+	kunmap(vb);
+	kunmap(va);
+	return same;
+}
+
+//
+// May the page 'pte' maps at 'va' in 'e' be merged?  Only private,
+// unshared pages are: merging the pages of the swap pager or the idle
+// environment could make them fault, and the kernel writes to the user
+// exception stack without going through copy-on-write.  The file server
+// (envs[1]) is left alone even when it isn't the swap pager: the new
+// mapping is clean, and its block cache writes back only dirty pages.
+// Nor are the pages of an environment running on another CPU, whose TLB
+// we can't flush.
+//
+static bool
+ksm_candidate(struct Env *e, uintptr_t va, pte_t pte)
+{
+	if (e->env_status == ENV_FREE || e == &envs[0] || e == &envs[1]
+	    || e == swap_pager)
+		return 0;
+	if (e->env_cpunum >= 0 && e->env_cpunum != cpunum())
+		return 0;
+	if ((pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U) || (pte & PTE_SHARE))
+		return 0;
+	if (va == UXSTACKTOP - PGSIZE)
+		return 0;
+	return pa2page(PTE_ADDR(pte))->pp_ref == 1;
+}
+
+//
+// The permissions of 'pte' once it maps a merged frame: writable pages
+// become copy-on-write, like in fork.
+//
+static int
+ksm_perm(pte_t pte)
+{
+	int perm = pte & PTE_USER;
+
+	if (perm & (PTE_W | PTE_COW))
+		perm = (perm & ~PTE_W) | PTE_COW;
+	return perm;
+}
+
+//
+// The page an unstable entry stands for, if it is still a candidate.
+//
+static struct Page *
+ksm_item_page(struct Ksm_item *ki, struct Env **env_store, pte_t **pte_store)
+{
+	struct Env *e;
+	pte_t *pte;
+
+	if (envid2env(ki->ki_env, &e, 0) < 0)
+		return NULL;
+	pte = pgdir_walk(e->env_pgdir, (void *) ki->ki_va, 0);
+	if (pte == NULL || !ksm_candidate(e, ki->ki_va, *pte))
+		return NULL;
+	*env_store = e;
+	*pte_store = pte;
+	return pa2page(PTE_ADDR(*pte));
+}
+
+//
+// Map 'pp' at 'va' in 'e' in place of the page there, with 'perm'.
+// The page table exists, so this cannot fail.
+//
+static void
+ksm_replace(struct Env *e, uintptr_t va, struct Page *pp, int perm)
+{
+	int r;
+
+	r = page_insert(e->env_pgdir, pp, (void *) va, perm);
+	assert(r == 0);
+}
+
+//
+// Look for a page identical to the one '*pte' maps at 'va' in 'e', and
+// if there is one, merge the two.  Otherwise remember the page, so that
+// later pages can be merged with it.
+//
+static void
+ksm_page(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct Page *pp = pa2page(PTE_ADDR(*pte)), *other;
+	struct Ksm_frame *kf;
+	struct Ksm_item *ki;
+	struct Env *oe;
+	pte_t *opte;
+	int perm = ksm_perm(*pte);
+	uint32_t h;
+	bool zero;
+	void *kva;
+	int r;
+
+	kva = kmap(pp);
+	h = ksm_hash(kva);
+	zero = (h == ksm_zero_hash && ksm_is_zero(kva));
+	kunmap(kva);
+
+	if (zero) {
+		// page_map_zero() wants to be told PTE_W to make a
+		// copy-on-write mapping.
+		if (perm & PTE_COW)
+			perm = (perm & ~PTE_COW) | PTE_W;
+		r = page_map_zero(e->env_pgdir, (void *) va, perm);
+		assert(r == 0);
+		ksm_nzero++;
+		return;
+	}
+
+	LIST_FOREACH(kf, &ksm_stable[KSM_BUCKET(h)], kf_link)
+		if (kf->kf_hash == h && ksm_same(kf->kf_page, pp)) {
+			ksm_replace(e, va, kf->kf_page, perm);
+			ksm_nmerged++;
+			return;
+		}
+
+	LIST_FOREACH(ki, &ksm_unstable[KSM_BUCKET(h)], ki_link) {
+		if (ki->ki_hash != h
+		    || (other = ksm_item_page(ki, &oe, &opte)) == NULL
+		    || other == pp || !ksm_same(other, pp))
+			continue;
+
+		// Make the other page a stable frame and map it here too.
+		if ((kf = kmem_cache_alloc(ksm_frame_cache)) == NULL)
+			return;
+		kf->kf_hash = h;
+		kf->kf_page = other;
+		other->pp_ref++;
+		LIST_INSERT_HEAD(&ksm_stable[KSM_BUCKET(h)], kf, kf_link);
+
+		*opte = PTE_ADDR(*opte) | ksm_perm(*opte);
+		tlb_invalidate(oe->env_pgdir, (void *) ki->ki_va);
+		LIST_REMOVE(ki, ki_link);
+		kmem_cache_free(ksm_item_cache, ki);
+		ksm_nitems--;
+
+		ksm_replace(e, va, other, perm);
+		ksm_nmerged++;
+		return;
+	}
+
+	if (ksm_nitems < KSM_MAXITEMS
+	    && (ki = kmem_cache_alloc(ksm_item_cache)) != NULL) {
+		ki->ki_hash = h;
+		ki->ki_env = e->env_id;
+		ki->ki_va = va;
+		LIST_INSERT_HEAD(&ksm_unstable[KSM_BUCKET(h)], ki, ki_link);
+		ksm_nitems++;
+	}
+}
+
+//
+// The cursor went over every environment: forget the unstable pages,
+// and let go of stable frames nobody maps any more.
+//
+static void
+ksm_end_pass(void)
+{
+	struct Ksm_frame *kf, *kfnext;
+	struct Ksm_item *ki;
+	int i;
+
+	for (i = 0; i < KSM_NHASH; i++) {
+		while ((ki = LIST_FIRST(&ksm_unstable[i])) != NULL) {
+			LIST_REMOVE(ki, ki_link);
+			kmem_cache_free(ksm_item_cache, ki);
+		}
+		for (kf = LIST_FIRST(&ksm_stable[i]); kf; kf = kfnext) {
+			kfnext = LIST_NEXT(kf, kf_link);
+			if (kf->kf_page->pp_ref > 1)
+				continue;
+			LIST_REMOVE(kf, kf_link);
+			page_decref(kf->kf_page);
+			kmem_cache_free(ksm_frame_cache, kf);
+		}
+	}
+	ksm_nitems = 0;
+	ksm_npasses++;
+}
+
+//
+// Called by the scheduler when there is nothing else to run: move the
+// cursor on by up to KSM_SCAN candidate pages.
+//
+void
+ksm_idle(void)
+{
+	struct Env *e;
+	pde_t pde;
+	pte_t *pte;
+	int nscan, n = 0;
+
+	for (nscan = 0; n < KSM_SCAN && nscan < KSM_SCANMAX; nscan++) {
+		e = &envs[ksm_env];
+		if (ksm_va >= UTOP || e->env_status == ENV_FREE) {
+			if (++ksm_env == NENV) {
+				ksm_env = 0;
+				ksm_end_pass();
+			}
+			ksm_va = 0;
+			continue;
+		}
+		pde = e->env_pgdir[PDX(ksm_va)];
+		if (!(pde & PTE_P)) {
+			ksm_va = ROUNDUP(ksm_va + 1, PTSIZE);
+			continue;
+		}
+
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(ksm_va);
+		if (ksm_candidate(e, ksm_va, *pte)) {
+			ksm_page(e, ksm_va, pte);
+			n++;
+		}
+		ksm_va += PGSIZE;
+	}
+}
+
+void
+ksm_print_stats(void)
+{
+	struct Ksm_frame *kf;
+	uint32_t nframes = 0, nmaps = 0, nsaved = 0;
+	int i;
+
+	// Each stable frame has one reference from the kernel, and
+	// stands in for a frame per mapping but the first.
+	for (i = 0; i < KSM_NHASH; i++)
+		LIST_FOREACH(kf, &ksm_stable[i], kf_link) {
+			nframes++;
+			nmaps += kf->kf_page->pp_ref - 1;
+			if (kf->kf_page->pp_ref > 2)
+				nsaved += kf->kf_page->pp_ref - 2;
+		}
+	cprintf("ksm: %d shared frames mapped %d times, %d frames saved\n",
+		nframes, nmaps, nsaved);
+	cprintf("%d pages merged, %d into the zero page, %d unstable, "
+		"%d passes\n", ksm_nmerged, ksm_nzero, ksm_nitems, ksm_npasses);
+}
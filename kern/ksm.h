@@ -0,0 +1,55 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+#include <inc/env.h>
+
+// Same-page merging.
+//
+// While the system is idle, a cursor walks over the private user pages
+// of all environments and hashes them.  A page found to be identical to
+// another one is mapped to that frame instead, copy-on-write in both
+// places, and its own frame is freed.  Pages of zeros are mapped to the
+// shared zero page.
+//
+// Frames that have been merged into are "stable": the kernel holds a
+// reference to each, and since every mapping of it is read-only or
+// copy-on-write, its contents never change.  Pages seen once but not
+// yet matched are remembered by environment and address in an
+// "unstable" table, forgotten at the end of every pass, since their
+// contents may change at any time.
+
+#define KSM_NHASH	256	// buckets of each table
+#define KSM_SCAN	16	// pages looked at per idle call
+#define KSM_SCANMAX	1024	// most PTEs the cursor passes per idle call
+#define KSM_MAXITEMS	4096	// most unstable entries kept in a pass
+
+struct Page;
+
+LIST_HEAD(Ksm_frame_list, Ksm_frame);
+LIST_HEAD(Ksm_item_list, Ksm_item);
+
+struct Ksm_frame {
+	LIST_ENTRY(Ksm_frame) kf_link;	// stable hash bucket
+	uint32_t kf_hash;
+	struct Page *kf_page;		// the kernel holds a reference
+};
+
+struct Ksm_item {
+	LIST_ENTRY(Ksm_item) ki_link;	// unstable hash bucket
+	uint32_t ki_hash;
+	envid_t ki_env;			// where the page was seen
+	uintptr_t ki_va;
+};
+
+void	ksm_init(void);
+void	ksm_idle(void);
+void	ksm_print_stats(void);
+
+#endif	// !JOS_KERN_KSM_H
@@ -0,0 +1,260 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 8 & Appendix C of Intel processor manual volume 3.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <inc/timerreg.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+	#define BUSY       0x00001000
+	#define FIXED      0x00000000
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define PERIODIC   0x00020000   // Periodic
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+// Timer count to fall back on if calibration fails: in the same
+// ballpark as TIMER_HZ on QEMU.
+#define LAPIC_TIMER_COUNT	10000000
+
+volatile uint32_t *lapic;  // Initialized in lapic_init()
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+//
+// Count how far this CPU's LAPIC timer runs down during one timer tick
+// (1/TIMER_HZ s), timed by the 8253 (see pit_oneshot()).  The bus
+// clock, and so the count, may differ between CPUs.
+//
+static uint32_t
+lapic_calibrate(void)
+{
+	uint32_t count;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xFFFFFFFF);
+	pit_oneshot(TIMER_DIV(TIMER_HZ));
+	while (!pit_expired())
+		;
+	count = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+	return count ? count : LAPIC_TIMER_COUNT;
+}
+
+void
+lapic_init(void)
+{
+	thiscpu->cpu_boot_tsc = read_tsc();
+	if (!lapicaddr)
+		return;
+
+	// lapicaddr is the physical address of the LAPIC's 4K MMIO
+	// region.  Map it in to virtual memory so we can access it.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// The timer repeatedly counts down at bus frequency
+	// from lapic[TICR] and then issues an interrupt.
+	// The boot CPU keeps the 8253 on IRQ_TIMER, through the I/O APIC
+	// or the 8259A; the others get TIMER_HZ ticks from here.
+	if (!thiscpu->cpu_lapic_count)
+		thiscpu->cpu_lapic_count = lapic_calibrate();
+	if (thiscpu != bootcpu) {
+		lapicw(TDCR, X1);
+		lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+		lapicw(TICR, thiscpu->cpu_lapic_count);
+	} else
+		lapicw(TIMER, MASKED);
+
+	// Without an I/O APIC, leave LINT0 of the BSP enabled so that it
+	// can get interrupts from the 8259A chip.
+	//
+	// According to Intel MP Specification, the BIOS should initialize
+	// BSP's local APIC in Virtual Wire Mode, in which 8259A's
+	// INTR is virtually connected to BSP's LINTIN0. In this mode,
+	// we do not need to program the IOAPIC.
+	if (thiscpu != bootcpu || ioapicaddr)
+		lapicw(LINT0, MASKED);
+
+	// Disable NMI (LINT1) on all CPUs
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// There is no handler for APIC errors: leave them masked.
+	lapicw(ERROR, MASKED);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Send an Init Level De-Assert to synchronize arbitration ID's.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, BCAST | INIT | LEVEL);
+	while(lapic[ICRLO] & DELIVS)
+		;
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+}
+
+int
+cpunum(void)
+{
+	if (lapic)
+		return lapic[ID] >> 24;
+	return 0;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+//
+// This CPU is going idle: stop its periodic tick, and have its LAPIC
+// timer interrupt once after 'ticks' ticks, or not at all if 'ticks' is
+// 0.  The boot CPU's tick is the 8253, which is masked at the I/O APIC;
+// without an I/O APIC (or a local APIC) the tick keeps going.
+//
+void
+lapic_timer_idle(uint32_t ticks)
+{
+	if (!lapic || (thiscpu == bootcpu && !ioapicaddr))
+		return;
+	if (thiscpu == bootcpu)
+		ioapic_disable(IRQ_TIMER);
+
+	if (ticks == 0) {
+		lapicw(TIMER, MASKED);
+		lapicw(TICR, 0);
+		return;
+	}
+	ticks = MIN(ticks, 0xFFFFFFFF / thiscpu->cpu_lapic_count);
+	lapicw(TDCR, X1);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);	// one-shot
+	lapicw(TICR, ticks * thiscpu->cpu_lapic_count);
+}
+
+// Undo lapic_timer_idle(): restart this CPU's periodic tick.
+void
+lapic_timer_resume(void)
+{
+	if (!lapic || (thiscpu == bootcpu && !ioapicaddr))
+		return;
+	if (thiscpu == bootcpu) {
+		lapicw(TIMER, MASKED);
+		ioapic_enable(IRQ_TIMER, bootcpu->cpu_id);
+	} else {
+		lapicw(TDCR, X1);
+		lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+		lapicw(TICR, thiscpu->cpu_lapic_count);
+	}
+}
+
+// Send interrupt 'vector' to the CPU whose local APIC ID is 'apicid'.
+void
+lapic_ipi(int apicid, int vector)
+{
+	if (!lapic)
+		return;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Spin for a given number of microseconds.
+// On real hardware would want to tune this dynamically.
+static void
+microdelay(int us)
+{
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	microdelay(100);    // should be 10ms, but too slow in Bochs!
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	// Bochs complains about the second one.  Too bad for Bochs.
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRHI, apicid << 24);
+		lapicw(ICRLO, STARTUP | (addr >> 12));
+		microdelay(200);
+	}
+}
@@ -12,6 +12,13 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/env.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/sched.h>
+#include <kern/shm.h>
+#include <kern/picirq.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -40,7 +47,16 @@ static struct Command commands[] = {
 		any mapping in the current address space. \n \
 		you can add (+) or remove (-) the flags p, u and w", set_pagepriority },
 	{ "s", "Debugger step.", step},
-	{ "c", "Debugge continue", cont}
+	{ "c", "Debugge continue", cont},
+	{ "kmem", "Display kernel object cache usage", mon_kmem },
+	{ "zpool", "Display pre-zeroed page pool counters", mon_zpool },
+	{ "envs", "List environments and their page table usage", mon_envs },
+	{ "swap", "Display swap slot usage and counters", mon_swap },
+	{ "ksm", "Display same-page merging counters", mon_ksm },
+	{ "sched", "Display scheduler queue residency", mon_sched },
+	{ "shares", "Display each environment's share of the CPU", mon_shares },
+	{ "shm", "List named shared memory regions", mon_shm },
+	{ "irqs", "Display the interrupt controller and IRQ counts", mon_irqs }
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -176,6 +192,16 @@ read_eip()
 // =====================
 // Exercise 2 Challege 2:
 
+// Physical address that 'va' maps to through 'pte', which is a PDE
+// if pgdir_walk found a 4MB page.
+static physaddr_t
+pte2pa(pte_t pte, uintptr_t va)
+{
+	if (pte & PTE_PS)
+		return PTE_ADDR(pte) + (PTX(va) << PTXSHIFT) + PGOFF(va);
+	return PTE_ADDR(pte) + PGOFF(va);
+}
+
 int
 show_mapping(int argc, char **argv, struct Trapframe *tf)
 {
@@ -216,8 +242,9 @@ show_mapping(int argc, char **argv, struct Trapframe *tf)
 			cprintf("\t%08x\t%s\t%s\t\t%d\n", start, "Not mapping", 
 				"None", 0);
 		else
-			cprintf("\t%08x\t%08x\t%s\t%d\n", start, page2pa(pp),
-				pagepri2str(*ppte, buf), pp->pp_ref );
+			cprintf("\t%08x\t%08x\t%s\t%d\n", start,
+				pte2pa(*ppte, start), pagepri2str(*ppte, buf),
+				pp->pp_ref );
 	}
 	
 	return 0;	 
@@ -354,7 +381,7 @@ dump(int argc, char **argv, struct Trapframe *tf)
 			start += PGSIZE - start%PGSIZE;
 			continue;
 		}
-		cprintf("%08x\t", PTE_ADDR(*ppte)|PGOFF(start));
+		cprintf("%08x\t", pte2pa(*ppte, start));
 		for (i=0; i < 16 ; i++, start ++)
 		{
 			cprintf("%02x ",*(unsigned char *)start);
@@ -401,3 +428,79 @@ int cont(int argc, char **argv, struct Trapframe *tf)
 
 // ---------------------
 
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_zpool(int argc, char **argv, struct Trapframe *tf)
+{
+	page_zero_print_stats();
+	return 0;
+}
+
+int
+mon_envs(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t ntables, npages;
+	struct Env *e;
+
+	cprintf("env       parent    status  prio  cpu  migr  runs      pgtables  pages     swapin    swapout\n");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		pgdir_usage(e->env_pgdir, &ntables, &npages);
+		cprintf("%08x  %08x  %-6s  %-4u  %-3d  %-4u  %-8u  %-8u  %-8u  %-8u  %u\n",
+			e->env_id, e->env_parent_id,
+			e->env_status == ENV_RUNNABLE ? "run" : "wait",
+			e->env_priority, e->env_rqcpu, e->env_migrations,
+			e->env_runs, ntables, npages,
+			e->env_swapins, e->env_swapouts);
+	}
+	return 0;
+}
+
+int
+mon_swap(int argc, char **argv, struct Trapframe *tf)
+{
+	swap_print_stats();
+	return 0;
+}
+
+int
+mon_ksm(int argc, char **argv, struct Trapframe *tf)
+{
+	ksm_print_stats();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_stats();
+	return 0;
+}
+
+int
+mon_shares(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_shares();
+	return 0;
+}
+
+int
+mon_shm(int argc, char **argv, struct Trapframe *tf)
+{
+	shm_print_stats();
+	return 0;
+}
+
+int
+mon_irqs(int argc, char **argv, struct Trapframe *tf)
+{
+	irq_print_stats();
+	return 0;
+}
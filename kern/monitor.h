@@ -20,4 +20,13 @@ int dump(int argc, char **argv, struct Trapframe *tf);
 int set_pagepriority(int argc, char **argv, struct Trapframe *tf);
 int step(int argc, char **argv, struct Trapframe *tf);
 int cont(int argc, char **argv, struct Trapframe *tf);
+int mon_kmem(int argc, char **argv, struct Trapframe *tf);
+int mon_zpool(int argc, char **argv, struct Trapframe *tf);
+int mon_envs(int argc, char **argv, struct Trapframe *tf);
+int mon_swap(int argc, char **argv, struct Trapframe *tf);
+int mon_ksm(int argc, char **argv, struct Trapframe *tf);
+int mon_sched(int argc, char **argv, struct Trapframe *tf);
+int mon_shares(int argc, char **argv, struct Trapframe *tf);
+int mon_shm(int argc, char **argv, struct Trapframe *tf);
+int mon_irqs(int argc, char **argv, struct Trapframe *tf);
 #endif	// !JOS_KERN_MONITOR_H
@@ -3,6 +3,7 @@
 #include <inc/assert.h>
 
 #include <kern/picirq.h>
+#include <kern/cpu.h>
 
 
 // Current IRQ mask.
@@ -10,6 +11,8 @@
 uint16_t irq_mask_8259A = 0xFFFF & ~(1<<IRQ_SLAVE);
 static bool didinit;
 
+uint32_t irq_count[MAX_IRQS];
+
 /* Initialize the 8259A interrupt controllers. */
 void
 pic_init(void)
@@ -63,6 +66,10 @@ pic_init(void)
 	outb(IO_PIC2, 0x68);               /* OCW3 */
 	outb(IO_PIC2, 0x0a);               /* OCW3 */
 
+	// With an I/O APIC, the 8259A stays out of the way: all of its
+	// interrupts stay masked.
+	if (ioapicaddr)
+		irq_mask_8259A = 0xFFFF;
 	if (irq_mask_8259A != 0xFFFF)
 		irq_setmask_8259A(irq_mask_8259A);
 }
@@ -83,3 +90,31 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+//
+// Let IRQ 'irq' through to the boot CPU: through the I/O APIC if there
+// is one, else by unmasking it on the 8259A.
+//
+void
+irq_enable(int irq)
+{
+	if (ioapicaddr)
+		ioapic_enable(irq, bootcpu->cpu_id);
+	else
+		irq_setmask_8259A(irq_mask_8259A & ~(1<<irq));
+}
+
+void
+irq_print_stats(void)
+{
+	int i;
+
+	cprintf("interrupt controller: %s\n",
+		ioapicaddr ? "local APIC + I/O APIC" : "8259A");
+	for (i = 0; i < ncpu; i++)
+		cprintf("  cpu %d: LAPIC timer %u counts per tick%s\n",
+			i, cpus[i].cpu_lapic_count,
+			&cpus[i] == bootcpu ? " (ticks from the 8253)" : "");
+	for (i = 0; i < MAX_IRQS; i++)
+		if (irq_count[i])
+			cprintf("  irq %2d: %u\n", i, irq_count[i]);
+}
@@ -24,6 +24,15 @@
 extern uint16_t irq_mask_8259A;
 void pic_init(void);
 void irq_setmask_8259A(uint16_t mask);
+
+// The I/O APIC, used instead of the 8259A when mp_init() finds one
+void ioapic_init(void);
+void ioapic_enable(int irq, int apicid);
+void ioapic_disable(int irq);
+
+extern uint32_t irq_count[MAX_IRQS];	// interrupts taken per IRQ
+void irq_enable(int irq);
+void irq_print_stats(void);
 #endif // !__ASSEMBLER__
 
 #endif // !JOS_KERN_PICIRQ_H
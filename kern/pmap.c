@@ -11,20 +11,62 @@
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/swap.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
 size_t npage;			// Amount of physical memory (in pages)
+size_t npage_low;		// Pages of it mapped at KERNBASE (lowmem)
 static size_t basemem;		// Amount of base memory (in bytes)
 static size_t extmem;		// Amount of extended memory (in bytes)
 
+// Usable RAM ranges, from the BIOS's E820 map (or made up from CMOS).
+static struct E820_entry e820_map[E820_MAX];
+static uint32_t e820_nr;
+
+// pages[] has to fit in the PTSIZE window at UPAGES; memory beyond what
+// that can describe is ignored.
+#define PAGES_MAXPA	((uint64_t) (PTSIZE / sizeof(struct Page)) * PGSIZE)
+
 // These variables are set in i386_vm_init()
 pde_t* boot_pgdir;		// Virtual address of boot time page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 static char* boot_freemem;	// Pointer to next byte of free mem
+static bool kern_bigpages;	// KERNBASE is mapped with 4MB PSE pages
+static uint32_t kern_global;	// PTE_G if the CPU supports global pages
+uint32_t mpentry_cr4;		// CR4 bits APs need before paging is on
 
 struct Page* pages;		// Virtual address of physical page array
-static struct Page_list page_free_list;	// Free list of physical pages
+
+// Buddy free lists: page_free_list[o] holds the free blocks of order o
+// in lowmem, highmem_free_list[o] those in highmem.
+static struct Page_list page_free_list[BUDDY_NORDER];
+static struct Page_list highmem_free_list[BUDDY_NORDER];
+static uint32_t page_nfree;		// pages on the buddy free lists
+
+// The page table behind the kmap() window at KMAPBASE.
+static pte_t *kmap_pt;
+// The page table behind the MMIO region at MMIOBASE, and its next
+// free address.
+static pte_t *mmio_pt;
+static uintptr_t mmio_next = MMIOBASE;
+static uint32_t kmap_next;	// slot to try first
+
+// Pages that have been zeroed ahead of time.  To the buddy allocator
+// these are allocated pages.
+static struct Page_list zero_pool;
+static uint32_t zero_pool_count;
+static uint32_t zero_pool_hits;		// page_alloc_zero() served from the pool
+static uint32_t zero_pool_misses;	// page_alloc_zero() had to zero a page
+
+// The page of zeros behind every demand-zero mapping.  It is pinned:
+// it may be mapped more often than a 16-bit pp_ref can count.
+static struct Page *zero_page;
+
+// The TLB batch in progress, if any; see tlb_batch_begin().
+static struct Tlb_batch *tlb_batch;
 
 // Global descriptor table.
 //
@@ -49,8 +91,9 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in idt_init()
-	[GD_TSS >> 3] = SEG_NULL
+	// 0x28 - one tss per CPU, initialized in trap_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL,
+	[(GD_TSS0 >> 3) + NCPU - 1] = SEG_NULL
 };
 
 //TODO: What is this syntax?
@@ -67,21 +110,72 @@ nvram_read(int r)
 void
 i386_detect_memory(void)
 {
-	// CMOS tells us how many kilobytes there are
-	basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
-	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
+	uint32_t *nr = (uint32_t *) (KERNBASE + E820MAP);
+	struct E820_entry *e = (struct E820_entry *) (nr + 1);
+	uint64_t end;
+	uint32_t i;
+
+	// The boot loader got the E820 map from the BIOS.  Keep its RAM
+	// ranges, clipped to what pages[] can describe.
+	maxpa = basemem = 0;
+	for (i = 0; i < *nr && i < E820_MAX; i++) {
+		if (e[i].e_type != E820_RAM || e[i].e_addr >= PAGES_MAXPA)
+			continue;
+		end = MIN(e[i].e_addr + e[i].e_len, PAGES_MAXPA);
+		e820_map[e820_nr] = e[i];
+		e820_map[e820_nr].e_len = end - e[i].e_addr;
+		e820_nr++;
+		if (e[i].e_addr == 0)
+			basemem = ROUNDDOWN(end, PGSIZE);
+		if (end > maxpa)
+			maxpa = ROUNDDOWN(end, PGSIZE);
+	}
 
-	// Calculate the maximum physical address based on whether
-	// or not there is any extended memory.  See comment in <inc/mmu.h>.
-	if (extmem)
-		maxpa = EXTPHYSMEM + extmem;
-	else
-		maxpa = basemem;
+	if (e820_nr == 0) {
+		// No E820: CMOS tells us how many kilobytes there are,
+		// but it can't count past 64MB.
+		basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
+		extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
+
+		// Calculate the maximum physical address based on whether
+		// or not there is any extended memory.  See comment in <inc/mmu.h>.
+		if (extmem)
+			maxpa = EXTPHYSMEM + extmem;
+		else
+			maxpa = basemem;
+
+		e820_map[0].e_addr = 0;
+		e820_map[0].e_len = basemem;
+		e820_map[1].e_addr = EXTPHYSMEM;
+		e820_map[1].e_len = extmem;
+		e820_nr = 2;
+	} else
+		extmem = maxpa > EXTPHYSMEM ? maxpa - EXTPHYSMEM : 0;
 
 	npage = maxpa / PGSIZE;
+	npage_low = MIN(npage, (MMIOBASE - KERNBASE) / PGSIZE);
 
 	cprintf("Physical memory: %dK available, ", (int)(maxpa/1024));
 	cprintf("base = %dK, extended = %dK\n", (int)(basemem/1024), (int)(extmem/1024));
+	if (npage > npage_low)
+		cprintf("  lowmem = %dK, highmem = %dK\n",
+			(int)(npage_low*PGSIZE/1024),
+			(int)((npage-npage_low)*PGSIZE/1024));
+}
+
+//
+// Is the physical page at 'pa' usable RAM according to the memory map?
+//
+static bool
+e820_is_ram(physaddr_t pa)
+{
+	uint32_t i;
+
+	for (i = 0; i < e820_nr; i++)
+		if (pa >= e820_map[i].e_addr
+		    && pa + PGSIZE <= e820_map[i].e_addr + e820_map[i].e_len)
+			return 1;
+	return 0;
 }
 
 // --------------------------------------------------------------
@@ -89,9 +183,19 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void check_boot_pgdir(void);
+static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page_alloc();
+static void check_buddy(void);
+static void check_zero_pool(void);
+static void check_demand_zero(void);
+static void check_highmem(void);
+static struct Page *pgtable_page(pde_t *pgdir, const void *va);
+static int pgtable_unref(pde_t *pgdir, uintptr_t va);
 static void page_check(void);
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void boot_map_segment_big(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static int page_zero_drain(void);
+static int buddy_alloc(struct Page_list *freelist, int order, struct Page **pp_store);
 
 //
 // A simple physical memory allocator, used only a few times
@@ -152,12 +256,18 @@ void
 i386_vm_init(void)
 {
 	pde_t* pgdir;
-	uint32_t cr0;
+	uint32_t cr0, cr4, edx;
 	size_t n;
 
 	// Delete this line:
 	// panic("i386_vm_init: This function is not finished\n");
 
+	//////////////////////////////////////////////////////////////////////
+	// Find out whether the CPU can do 4MB pages and global pages.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	kern_bigpages = JOS_BIGPAGES && (edx & CPUID_PSE);
+	kern_global = (JOS_BIGPAGES && (edx & CPUID_PGE)) ? PTE_G : 0;
+
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
 	pgdir = boot_alloc(PGSIZE, PGSIZE);
@@ -202,6 +312,16 @@ i386_vm_init(void)
 
 	check_page_alloc();
 
+	check_buddy();
+
+	check_zero_pool();
+
+	// Set up the shared zero page.
+	if (page_alloc_zero(&zero_page) < 0)
+		panic("i386_vm_init: no memory for the zero page");
+	zero_page->pp_ref = PP_REF_PINNED;
+	zero_page->pp_flags |= PP_PINNED;
+
 	page_check();
 
 	//////////////////////////////////////////////////////////////////////
@@ -213,12 +333,11 @@ i386_vm_init(void)
 	//    - the new image at UPAGES -- kernel R, user R
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
+	// These mappings are the same in every address space, so they
+	// are global: they survive the lcr3 in env_run.
+	// (pages itself is covered by the KERNBASE mapping below.)
 	boot_map_segment(pgdir, UPAGES, ROUNDUP(npage * sizeof(struct Page), PGSIZE),
-		PADDR(pages), PTE_U | PTE_P);
-
-	// TODO: Is this needed?
-	boot_map_segment(pgdir, (uintptr_t)pages, ROUNDUP(npage * sizeof(struct Page), PGSIZE),
-		PADDR(pages), PTE_W | PTE_P);
+		PADDR(pages), PTE_U | PTE_P | kern_global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -227,52 +346,58 @@ i386_vm_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3:
-	boot_map_segment(pgdir, (uintptr_t)envs, sizeof(struct Env) * NENV, 
-			PADDR(envs), PTE_W | PTE_P);
 	boot_map_segment(pgdir, UENVS, sizeof(struct Env) * NENV, 
-			PADDR(envs), PTE_U | PTE_P);
+			PADDR(envs), PTE_U | PTE_P | kern_global);
+
+	// Map the clock page read-only by the user at UCLOCK, in the last
+	// page of the UENVS window.
+	static_assert(sizeof(struct Env) * NENV <= UCLOCK - UENVS);
+	boot_map_segment(pgdir, UCLOCK, PGSIZE, PADDR(&uclock),
+			PTE_U | PTE_P | kern_global);
 
 	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP) 
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
+	// Map the kernel stacks of all CPUs, percpu_kstacks[i] for CPU i,
+	// from virtual address KSTACKTOP down.  Each stack is KSTKSIZE
+	// bytes, with a KSTKGAP unmapped gap below it as a guard, so if
+	// the kernel overflows its stack, it will fault rather than
+	// overwrite memory.  The boot CPU runs on 'bootstack' until it
+	// first enters user mode, and uses its percpu stack after that.
 	//     Permissions: kernel RW, user NONE
-	uintptr_t dest = (uintptr_t)bootstacktop - KSTKSIZE;
-	pte_t *pte;
-
-	// TODO: Review this code
-	// i is the offset, starting from the bottom 
-	uintptr_t i;
-	for(i = 0; i < PTSIZE; i += PGSIZE) {
-		pte = pgdir_walk(pgdir, (void*)((KSTACKTOP - PTSIZE) + i), 1);
-		assert(pte != NULL);
-
-		// Not backed by physical memory
-		if((KSTACKTOP - PTSIZE) + i < KSTACKTOP - KSTKSIZE) 
-			*pte = 0;
+	static_assert(NCPU * (KSTKSIZE + KSTKGAP) <= PTSIZE);
+	for (n = 0; n < NCPU; n++)
+		boot_map_segment(pgdir,
+			KSTACKTOP - n * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+			KSTKSIZE, PADDR(percpu_kstacks[n]),
+			PTE_W | PTE_P | kern_global);
 
-		// Backed by physical memory
-		else {
-	  		*pte = PADDR(dest) | PTE_P | PTE_W;
-	  		dest += PGSIZE;
-		}
-	}
+	//////////////////////////////////////////////////////////////////////
+	// Map physical memory at KERNBASE. 
+	// Ie.  the VA range [KERNBASE, MMIOBASE) should map to
+	//      the PA range [0, MMIOBASE - KERNBASE)
+	// We might not have MMIOBASE - KERNBASE bytes of physical memory, but
+	// we just set up the mapping anyway.  Physical memory above that
+	// (highmem) is only reached through kmap().
+	// Permissions: kernel RW, user NONE
+	// With PSE this takes 63 4MB PDEs instead of 63 page tables, and
+	// leaves far fewer kernel translations competing for the TLB.
+	if (kern_bigpages)
+		boot_map_segment_big(pgdir, KERNBASE, MMIOBASE - KERNBASE, 0,
+			PTE_W | PTE_P | kern_global);
+	else
+		boot_map_segment(pgdir, KERNBASE, MMIOBASE - KERNBASE, 0,
+			PTE_W | PTE_P | kern_global);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map all of physical memory at KERNBASE. 
-	// Ie.  the VA range [KERNBASE, 2^32) should map to
-	//      the PA range [0, 2^32 - KERNBASE)
-	// We might not have 2^32 - KERNBASE bytes of physical memory, but
-	// we just set up the mapping anyway.
+	// The kmap() window gets its page table now, so that the PDE is
+	// already there when env_setup_vm copies the kernel part of
+	// boot_pgdir, and all address spaces share the window.
 	// Permissions: kernel RW, user NONE
-	boot_map_segment(pgdir, KERNBASE, 0x0FFFFFFF + 1, 0, PTE_W|PTE_P);
-	//TODO: Check which one is correct.
-	boot_map_segment(pgdir, KERNBASE, 0xFFFFFFFF - KERNBASE /*=0x0FFFFFFF */, (physaddr_t)0x0, PTE_W | PTE_P);
+	kmap_pt = pgdir_walk(pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_pt != NULL);
+
+	// Same for the MMIO region.
+	mmio_pt = pgdir_walk(pgdir, (void *) MMIOBASE, 1);
+	assert(mmio_pt != NULL);
 
 
 	// Check that the initial page directory has been set up correctly.
@@ -294,7 +419,14 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	// This alias must not be global, or it would outlive the
+	// lcr3 that is supposed to kill it below.
+	pgdir[0] = pgdir[PDX(KERNBASE)] & ~PTE_G;
+
+	// 4MB pages must be enabled before paging sees them.
+	if (kern_bigpages)
+		lcr4(rcr4() | CR4_PSE);
+	mpentry_cr4 = rcr4();
 
 	// Install page table.
 	lcr3(boot_cr3);
@@ -326,10 +458,70 @@ i386_vm_init(void)
 
 	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
 	lcr3(boot_cr3);
+
+	// Only now honor PTE_G.  (Changing CR4.PGE flushes the whole TLB,
+	// global entries included.)
+	if (kern_global) {
+		cr4 = rcr4();
+		lcr4(cr4 | CR4_PGE);
+	}
+
+	// These need paging, for kmap().
+	check_demand_zero();
+	check_highmem();
+}
+
+//
+// The part of i386_vm_init() that every application processor needs as
+// well.  mpentry.S already turned on paging with boot_cr3 (and the CR4
+// bits in mpentry_cr4); switch to the kernel's segments and honor
+// PTE_G here too.
+//
+void
+pmap_init_percpu(void)
+{
+	asm volatile("lgdt gdt_pd");
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%es" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
+	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
+	asm volatile("lldt %%ax" :: "a" (0));
+
+	lcr3(boot_cr3);
+	if (kern_global)
+		lcr4(rcr4() | CR4_PGE);
+}
+
+//
+// Take every free page out of the allocator and chain them on 'fl',
+// so that a check can run against an allocator that is out of memory.
+// check_refill() gives them back.
+//
+static void
+check_drain(struct Page_list *fl)
+{
+	struct Page *pp;
+
+	page_list_init(fl);
+	while (page_alloc(&pp) == 0)
+		page_list_insert_head(fl, pp);
+}
+
+static void
+check_refill(struct Page_list *fl)
+{
+	struct Page *pp;
+
+	while ((pp = page_list_first(fl)) != NULL) {
+		page_list_remove(fl, pp);
+		page_free(pp);
+	}
 }
 
 //
-// Check the physical page allocator (g(), page_free(),
+// Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
 //
 static void
@@ -337,25 +529,33 @@ check_page_alloc()
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl;
+	int o, i;
 
 	// if there's a page that shouldn't be on
 	// the free list, try to make sure it
 	// eventually causes trouble.
-	LIST_FOREACH(pp0, &page_free_list, pp_link)
-		memset(page2kva(pp0), 0x97, 128);
-
-	LIST_FOREACH(pp0, &page_free_list, pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp0 >= pages);
-		assert(pp0 < pages + npage);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp0) != 0);
-		assert(page2pa(pp0) != IOPHYSMEM);
-		assert(page2pa(pp0) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp0) != EXTPHYSMEM);
-		assert(page2kva(pp0) != ROUNDDOWN(boot_freemem - 1, PGSIZE));
-	}
+	for (o = 0; o < BUDDY_NORDER; o++)
+		PAGE_LIST_FOREACH(pp0, &page_free_list[o])
+			for (i = 0; i < (1 << o); i++)
+				memset(page2kva(pp0 + i), 0x97, 128);
+
+	for (o = 0; o < BUDDY_NORDER; o++)
+		PAGE_LIST_FOREACH(pp0, &page_free_list[o]) {
+			// check that we didn't corrupt the free lists
+			assert(pp0 >= pages);
+			assert(pp0 + (1 << o) <= pages + npage);
+			assert(page2ppn(pp0) % (1 << o) == 0);
+			assert((pp0->pp_flags & PP_FREE) && pp0->pp_order == o);
+
+			// check a few pages that shouldn't be on the free list
+			for (pp = pp0; pp < pp0 + (1 << o); pp++) {
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2kva(pp) != ROUNDDOWN(boot_freemem - 1, PGSIZE));
+			}
+		}
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -371,8 +571,7 @@ check_page_alloc()
 	assert(page2pa(pp2) < npage*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_drain(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -391,7 +590,7 @@ check_page_alloc()
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
 	// give free list back
-	page_free_list = fl;
+	check_refill(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -401,6 +600,217 @@ check_page_alloc()
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check that the buddy allocator splits larger blocks to satisfy
+// small requests and merges freed buddies back together.
+//
+static void
+check_buddy(void)
+{
+	struct Page *pp, *pp0, *pp1, *blk;
+	struct Page_list fl;
+	int i;
+
+	// multi-page blocks are naturally aligned
+	assert(page_alloc_order(&blk, 2) == 0);
+	assert(page2ppn(blk) % 4 == 0);
+	assert(blk->pp_order == 2);
+	assert(page_alloc_order(&pp, BUDDY_NORDER) == -E_INVAL);
+
+	// from here on the allocator only holds what we give back to it
+	check_drain(&fl);
+	assert(page_alloc(&pp) == -E_NO_MEM);
+
+	// freeing the block one page at a time merges it back together
+	for (i = 0; i < 4; i++)
+		page_free(blk + i);
+	assert(page_list_empty(&page_free_list[0]));
+	assert(page_list_empty(&page_free_list[1]));
+	assert(page_list_first(&page_free_list[2]) == blk);
+	assert(page_alloc_order(&pp, 3) == -E_NO_MEM);
+
+	// a single-page request splits it, leaving an order-0
+	// and an order-1 buddy behind
+	assert(page_alloc(&pp0) == 0 && pp0 == blk);
+	assert(page_list_empty(&page_free_list[2]));
+	assert(page_list_first(&page_free_list[0]) == blk + 1);
+	assert(page_list_first(&page_free_list[1]) == blk + 2);
+	assert(page_alloc_order(&pp1, 1) == 0 && pp1 == blk + 2);
+	assert(page_alloc_order(&pp, 1) == -E_NO_MEM);
+
+	// freeing in the other order coalesces all the way up again
+	page_free_order(pp1, 1);
+	assert(page_list_first(&page_free_list[1]) == blk + 2);
+	page_free(pp0);
+	assert(page_list_empty(&page_free_list[0]));
+	assert(page_list_empty(&page_free_list[1]));
+	assert(page_alloc_order(&pp, 2) == 0 && pp == blk);
+
+	// give everything back
+	check_refill(&fl);
+	page_free_order(blk, 2);
+
+	cprintf("check_buddy() succeeded!\n");
+}
+
+//
+// Check the pre-zeroed page pool.
+//
+static void
+check_zero_pool(void)
+{
+	struct Page *pp, *pp0;
+	struct Page_list fl;
+	uint8_t *p;
+	int i;
+
+	assert(zero_pool_count == 0);
+	page_zero_refill();
+	assert(zero_pool_count == ZPOOL_BATCH);
+
+	// pool pages come out zeroed
+	pp0 = page_list_first(&zero_pool);
+	assert(page_alloc_zero(&pp) == 0 && pp == pp0);
+	assert(zero_pool_hits == 1 && zero_pool_count == ZPOOL_BATCH - 1);
+	for (p = page2kva(pp), i = 0; i < PGSIZE; i++)
+		assert(p[i] == 0);
+	page_free(pp);
+
+	// when memory runs out, the pool is given back
+	check_drain(&fl);
+	assert(zero_pool_count == 0);
+	assert(page_alloc(&pp) == -E_NO_MEM);
+	assert(page_alloc_zero(&pp) == -E_NO_MEM);
+	page_zero_refill();
+	assert(zero_pool_count == 0);
+
+	// misses still hand out zeroed pages
+	pp0 = page_list_first(&fl);
+	page_list_remove(&fl, pp0);
+	memset(page2kva(pp0), 0x97, PGSIZE);
+	page_free(pp0);
+	assert(page_alloc_zero(&pp) == 0 && pp == pp0);
+	for (p = page2kva(pp), i = 0; i < PGSIZE; i++)
+		assert(p[i] == 0);
+	page_free(pp);
+	check_refill(&fl);
+
+	zero_pool_hits = zero_pool_misses = 0;
+	cprintf("check_zero_pool() succeeded!\n");
+}
+
+//
+// Check demand-zero and copy-on-write mappings, using a low address
+// in boot_pgdir.
+//
+static void
+check_demand_zero(void)
+{
+	void *va = (void *) PGSIZE;
+	struct Page *pp, *pp0;
+	char *p, *p0;
+	pte_t *pte;
+	int i;
+
+	// read-only requests just get the zero page
+	assert(page_map_zero(boot_pgdir, va, PTE_U | PTE_P) == 0);
+	assert(check_va2pa(boot_pgdir, (uintptr_t) va) == page2pa(zero_page));
+	assert(zero_page->pp_ref == PP_REF_PINNED);
+	pte = pgdir_walk(boot_pgdir, va, 0);
+	assert(!(*pte & (PTE_W | PTE_COW)));
+	assert(page_cow_fault(boot_pgdir, va) == -E_INVAL);
+
+	// writable ones are COW on the zero page until written
+	assert(page_map_zero(boot_pgdir, va, PTE_U | PTE_W | PTE_P) == 0);
+	assert(zero_page->pp_ref == PP_REF_PINNED);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(page_cow_fault(boot_pgdir, va) == 0);
+	assert(zero_page->pp_ref == PP_REF_PINNED);
+	assert((*pte & (PTE_W | PTE_COW | PTE_U)) == (PTE_W | PTE_U));
+	pp = page_lookup(boot_pgdir, va, NULL);
+	assert(pp != zero_page && pp->pp_ref == 1);
+	p = kmap(pp);
+	for (i = 0; i < PGSIZE; i++)
+		assert(p[i] == 0);
+	assert(page_cow_fault(boot_pgdir, va) == -E_INVAL);
+
+	// a shared copy-on-write page is copied on the first write,
+	// and the last one left gets to keep it
+	memset(p, 0x5a, PGSIZE);
+	kunmap(p);
+	assert(page_insert(boot_pgdir, pp, va, PTE_U | PTE_COW) == 0);
+	assert(page_insert(boot_pgdir, pp, va + PGSIZE, PTE_U | PTE_COW) == 0);
+	assert(pp->pp_ref == 2);
+	assert(page_cow_fault(boot_pgdir, va) == 0);
+	pp0 = page_lookup(boot_pgdir, va, &pte);
+	assert(pp0 != pp && pp->pp_ref == 1 && pp0->pp_ref == 1);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	p0 = kmap(pp0);
+	p = kmap(pp);
+	assert(memcmp(p0, p, PGSIZE) == 0);
+	kunmap(p);
+	kunmap(p0);
+	assert(page_cow_fault(boot_pgdir, va + PGSIZE) == 0);
+	assert(page_lookup(boot_pgdir, va + PGSIZE, &pte) == pp);
+	assert((*pte & (PTE_W | PTE_COW)) == PTE_W);
+	page_remove(boot_pgdir, va + PGSIZE);
+
+	// clean up; the page table goes with its last page
+	page_remove(boot_pgdir, va);
+	assert(boot_pgdir[PDX(va)] == 0);
+
+	// mapping the zero page more often than pp_ref can count
+	// doesn't free it when the mappings go away
+	for (i = 0; i < 0x10001; i++)
+		assert(page_map_zero(boot_pgdir, va + i * PGSIZE,
+				     PTE_U | PTE_P) == 0);
+	page_remove_range(boot_pgdir, (uintptr_t) va, 0x10001 * PGSIZE);
+	assert(zero_page->pp_ref == PP_REF_PINNED);
+	assert(!(zero_page->pp_flags & PP_FREE));
+	assert(boot_pgdir[PDX(va)] == 0);
+
+	cprintf("check_demand_zero() succeeded!\n");
+}
+
+//
+// Check page_alloc_high() and kmap(), if there is any highmem.
+//
+static void
+check_highmem(void)
+{
+	struct Page *pp0, *pp1;
+	char *va0, *va1;
+
+	if (npage == npage_low)
+		return;
+
+	assert(page_alloc_high_zero(&pp0) == 0 && page_is_high(pp0));
+	assert(page_alloc_high(&pp1) == 0 && page_is_high(pp1));
+	assert(pp0 != pp1);
+
+	// each page gets a slot of its own in the window
+	va0 = kmap(pp0);
+	va1 = kmap(pp1);
+	assert((uintptr_t) va0 >= KMAPBASE && (uintptr_t) va1 >= KMAPBASE);
+	assert(va0 != va1);
+	assert(check_va2pa(boot_pgdir, (uintptr_t) va0) == page2pa(pp0));
+	assert(va0[0] == 0 && va0[PGSIZE - 1] == 0);
+
+	// the contents survive kunmap() and a new kmap()
+	memset(va1, 0x5a, PGSIZE);
+	kunmap(va1);
+	assert(check_va2pa(boot_pgdir, (uintptr_t) va1) == ~0);
+	va1 = kmap(pp1);
+	assert(va1[0] == 0x5a && va1[PGSIZE - 1] == 0x5a);
+	kunmap(va1);
+	kunmap(va0);
+
+	page_free(pp0);
+	page_free(pp1);
+
+	cprintf("check_highmem() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly(by i386_vm_init()).
@@ -409,7 +819,6 @@ check_page_alloc()
 // in fact it doesn't test the permission bits at all,
 // but it is a pretty good sanity check. 
 //
-static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 
 static void
 check_boot_pgdir(void)
@@ -428,14 +837,26 @@ check_boot_pgdir(void)
 	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	assert(check_va2pa(pgdir, UCLOCK) == PADDR(&uclock));
 
 	// check phys mem
-	for (i = 0; i < npage * PGSIZE; i += PGSIZE)
+	for (i = 0; i < npage_low * PGSIZE; i += PGSIZE) {
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
-
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+		assert(page_lookup(pgdir, (void *) (KERNBASE + i), NULL)
+		       == pa2page(i));
+	}
+	assert(check_va2pa(pgdir, MMIOBASE) == ~0);
+	assert(check_va2pa(pgdir, KMAPBASE) == ~0);
+
+	// check kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
 	// check for zero/non-zero in PDEs
@@ -472,6 +893,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -504,8 +927,16 @@ page_init(void)
 	//     Some of it is in use, some is free. Where is the kernel
 	//     in physical memory?  Which pages are already in use for
 	//     page tables and other data structures?
+	//  5) Anything the memory map doesn't call RAM is never free.
+	//
+	// Free pages are handed to page_free() one at a time, which
+	// coalesces them into the largest buddy blocks possible.
 	int i;
-	LIST_INIT(&page_free_list);
+	for (i = 0; i < BUDDY_NORDER; i++) {
+		page_list_init(&page_free_list[i]);
+		page_list_init(&highmem_free_list[i]);
+	}
+	page_list_init(&zero_pool);
 	for (i = 0; i < npage; i++) {
 		// Physical page 0 as in use (TODO: Why?).		
 		if (i == 0) 
@@ -517,8 +948,10 @@ page_init(void)
 		if (i >= PADDR(KERNBASE) / PGSIZE && i < 
 				ROUNDUP(PADDR(boot_freemem), PGSIZE) / PGSIZE)
 			continue;
+		if (!e820_is_ram(i * PGSIZE))
+			continue;
 		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
+		page_free(&pages[i]);
 	}
 }
 
@@ -533,6 +966,58 @@ page_initpp(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
+//
+// Put the block of 2^order pages starting at 'pp' on its free list.
+//
+static void
+buddy_insert(struct Page *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	page_nfree += 1 << order;
+	if (page_is_high(pp))
+		page_list_insert_head(&highmem_free_list[order], pp);
+	else
+		page_list_insert_head(&page_free_list[order], pp);
+}
+
+//
+// Is there any free lowmem block at all?
+//
+static bool
+buddy_has_free(void)
+{
+	int o;
+
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++)
+		if (!page_list_empty(&page_free_list[o]))
+			return 1;
+	return 0;
+}
+
+//
+// Take the free block starting at 'pp' off its free list.
+//
+static void
+buddy_remove(struct Page *pp)
+{
+	if (page_is_high(pp))
+		page_list_remove(&highmem_free_list[pp->pp_order], pp);
+	else
+		page_list_remove(&page_free_list[pp->pp_order], pp);
+	pp->pp_flags &= ~PP_FREE;
+	page_nfree -= 1 << pp->pp_order;
+}
+
+//
+// The number of free pages, counting those zeroed ahead of time.
+//
+uint32_t
+page_free_count(void)
+{
+	return page_nfree + zero_pool_count;
+}
+
 //
 // Allocates a physical page.
 // Does NOT set the contents of the physical page to zero, NOR does it
@@ -546,20 +1031,177 @@ page_initpp(struct Page *pp)
 //   0 -- on success
 //   -E_NO_MEM -- otherwise 
 //
-// Hint: use LIST_FIRST, LIST_REMOVE, and page_initpp
+// This is the order-0 fast path of page_alloc_order().
+//
 int
 page_alloc(struct Page **pp_store)
 {
-	// First, check if there are any free pages to allocate.
-	if (LIST_EMPTY(&page_free_list))
+	struct Page *pp;
+
+	// Take a single page straight off the order-0 list if we can;
+	// only go splitting larger blocks when it is empty.
+	if ((pp = page_list_first(&page_free_list[0])) == NULL)
+		return page_alloc_order(pp_store, 0);
+
+	buddy_remove(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size.
+// Like page_alloc(), the contents and the reference counts are left
+// alone.  *pp_store is set to the Page struct of the first page.
+//
+// The smallest free block that is big enough gets split in halves,
+// returning the unused upper halves to the free lists, until it has
+// the requested size.
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- if there is no free block big enough
+//   -E_INVAL -- if order is out of range
+//
+int
+page_alloc_order(struct Page **pp_store, int order)
+{
+	if (order < 0 || order > BUDDY_MAX_ORDER)
+		return -E_INVAL;
+
+	while (buddy_alloc(page_free_list, order, pp_store) < 0)
+		// Zeroing pages ahead of time must never make us run out
+		// of memory: give the pool back before failing.
+		if (page_zero_drain() == 0)
+			return -E_NO_MEM;
+	return 0;
+}
+
+//
+// Take a block of 2^order pages from the buddy free lists 'freelist'
+// (lowmem or highmem), splitting a bigger block if need be.
+//
+static int
+buddy_alloc(struct Page_list *freelist, int order, struct Page **pp_store)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = order; o <= BUDDY_MAX_ORDER; o++)
+		if (!page_list_empty(&freelist[o]))
+			break;
+	if (o > BUDDY_MAX_ORDER)
 		return -E_NO_MEM;
-	
-	// If there is one, put it in *pp_store and remove if from the free_list.
-	*pp_store = LIST_FIRST(&page_free_list);
-	LIST_REMOVE(*pp_store, pp_link);
+
+	pp = page_list_first(&freelist[o]);
+	buddy_remove(pp);
+	while (o > order) {
+		o--;
+		buddy_insert(pp + (1 << o), o);
+	}
+
+	pp->pp_order = order;
+	*pp_store = pp;
 	return 0;
 }
 
+//
+// Allocates a physical page for use by user environments only, which
+// the kernel reaches, if at all, through kmap().  Such pages come from
+// highmem as long as there is any, sparing lowmem for the kernel.
+// Otherwise like page_alloc().  The last few free pages are kept for
+// the swap pager (see swap_may_alloc()).
+//
+int
+page_alloc_high(struct Page **pp_store)
+{
+	if (!swap_may_alloc())
+		return -E_NO_MEM;
+	if (buddy_alloc(highmem_free_list, 0, pp_store) == 0)
+		return 0;
+	return page_alloc(pp_store);
+}
+
+//
+// Like page_alloc_high(), but the page is zeroed, like with
+// page_alloc_zero().
+//
+int
+page_alloc_high_zero(struct Page **pp_store)
+{
+	void *va;
+
+	if (!swap_may_alloc())
+		return -E_NO_MEM;
+	if (buddy_alloc(highmem_free_list, 0, pp_store) < 0)
+		return page_alloc_zero(pp_store);
+	va = kmap(*pp_store);
+	memset(va, 0, PGSIZE);
+	kunmap(va);
+	return 0;
+}
+
+//
+// Return a kernel virtual address for the page 'pp'.  Lowmem pages are
+// always mapped at KERNBASE; a highmem page is mapped into a free slot
+// of the window at KMAPBASE until kunmap().  The kernel doesn't
+// switch tasks inside itself, so a mapping is only ever held for a
+// short while, and a PTSIZE window has plenty of slots.
+//
+void *
+kmap(struct Page *pp)
+{
+	uint32_t i, slot;
+
+	if (!page_is_high(pp))
+		return page2kva(pp);
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		slot = (kmap_next + i) % NPTENTRIES;
+		if (!(kmap_pt[slot] & PTE_P)) {
+			kmap_pt[slot] = page2pa(pp) | PTE_W | PTE_P;
+			kmap_next = slot + 1;
+			// kunmap() only flushed the CPU that unmapped the
+			// slot; this one may still cache the old page.
+			invlpg((void *) (KMAPBASE + slot * PGSIZE));
+			return (void *) (KMAPBASE + slot * PGSIZE);
+		}
+	}
+	panic("kmap: no free slot");
+}
+
+//
+// Undo kmap().  'va' is the address kmap() returned.
+//
+void
+kunmap(void *va)
+{
+	if ((uintptr_t) va < KMAPBASE)
+		return;
+	kmap_pt[PTX(va)] = 0;
+	invlpg(va);
+}
+
+//
+// Map 'size' bytes of device memory at physical address 'pa' into the
+// MMIO region, uncached, and return its virtual address.  Mappings are
+// never taken down, so the region is just bumped.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	uintptr_t va = mmio_next;
+	size_t i;
+
+	size = ROUNDUP(pa + size, PGSIZE) - ROUNDDOWN(pa, PGSIZE);
+	pa = ROUNDDOWN(pa, PGSIZE);
+	if (size > MMIOLIM - mmio_next)
+		panic("mmio_map_region: out of MMIO space");
+	for (i = 0; i < size; i += PGSIZE)
+		mmio_pt[PTX(va + i)] = (pa + i) | PTE_PCD | PTE_PWT | PTE_W | PTE_P;
+	mmio_next += size;
+	return (void *) va;
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -567,18 +1209,201 @@ page_alloc(struct Page **pp_store)
 void
 page_free(struct Page *pp)
 {
+	page_free_order(pp, 0);
+}
+
+//
+// Return a block of 2^order pages to the allocator, merging it with
+// its buddy for as long as the buddy is a free block of the same size.
+// The pages of a block may also be freed one at a time with page_free();
+// they coalesce back into the full block once all of them are free.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	ppn_t ppn, bppn;
+	struct Page *buddy;
+
 	if (pp->pp_ref != 0)
 		panic("page_free(): Page was not freed. pp->pp_ref != 0.");
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);	
+	ppn = page2ppn(pp);
+	assert(order >= 0 && order <= BUDDY_MAX_ORDER);
+	assert(ppn % (1 << order) == 0);
+
+	for (; order < BUDDY_MAX_ORDER; order++) {
+		bppn = ppn ^ (1 << order);
+		if (bppn >= npage)
+			break;
+		buddy = &pages[bppn];
+		if (!(buddy->pp_flags & PP_FREE) || buddy->pp_order != order)
+			break;
+		buddy_remove(buddy);
+		ppn &= ~(1 << order);
+	}
+	buddy_insert(&pages[ppn], order);
+}
+
+//
+// Allocates a physical page whose contents are all zero.
+// Takes a page from the pre-zeroed pool if there is one, otherwise
+// falls back to page_alloc() and clears the page here.
+// Like page_alloc(), the reference count is not incremented.
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- otherwise
+//
+int
+page_alloc_zero(struct Page **pp_store)
+{
+	struct Page *pp;
+	int r;
+
+	if ((pp = page_list_first(&zero_pool)) != NULL) {
+		page_list_remove(&zero_pool, pp);
+		zero_pool_count--;
+		zero_pool_hits++;
+		*pp_store = pp;
+		return 0;
+	}
+
+	zero_pool_misses++;
+	if ((r = page_alloc(&pp)) < 0)
+		return r;
+	memset(page2kva(pp), 0, PGSIZE);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Zero up to ZPOOL_BATCH free pages and add them to the pool.
+// Called from the scheduler when there is nothing else to run, so
+// the work is kept small to not delay the next runnable env much.
+//
+void
+page_zero_refill(void)
+{
+	struct Page *pp;
+	int i;
+
+	for (i = 0; i < ZPOOL_BATCH && zero_pool_count < ZPOOL_MAX; i++) {
+		// Don't let page_alloc() drain the pool into itself.
+		if (!buddy_has_free())
+			break;
+		if (page_alloc(&pp) < 0)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		page_list_insert_head(&zero_pool, pp);
+		zero_pool_count++;
+	}
+}
+
+//
+// Give every page in the zero pool back to the page allocator.
+// Returns the number of pages released.
+//
+static int
+page_zero_drain(void)
+{
+	struct Page *pp;
+	int n = 0;
+
+	while ((pp = page_list_first(&zero_pool)) != NULL) {
+		page_list_remove(&zero_pool, pp);
+		page_free(pp);
+		n++;
+	}
+	zero_pool_count = 0;
+	return n;
+}
+
+void
+page_zero_print_stats(void)
+{
+	cprintf("zero pool: %d/%d pages, %d hits, %d misses\n",
+		zero_pool_count, ZPOOL_MAX, zero_pool_hits, zero_pool_misses);
+}
+
+//
+// Map the shared zero page at 'va' in 'pgdir', so that 'va' reads as
+// zeros without using a frame of its own.  If 'perm' has PTE_W, the
+// mapping is made read-only and PTE_COW, and page_cow_fault() gives it
+// a private page on the first write.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_map_zero(pde_t *pgdir, void *va, int perm)
+{
+	if (perm & PTE_W)
+		perm = (perm & ~PTE_W) | PTE_COW;
+	else
+		perm &= ~PTE_COW;
+	return page_insert(pgdir, zero_page, va, perm);
+}
+
+//
+// Resolve a write to the copy-on-write page at 'va'.
+//  - A demand-zero page gets a fresh zeroed page.
+//  - A page nobody else maps any more (pp_ref == 1) is simply made
+//    writable again; there is no one left to copy it for.
+//  - Otherwise the page is copied into a new page.
+// Either way the mapping ends up writable and no longer PTE_COW.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is not a copy-on-write mapping
+//   -E_NO_MEM, if there is no memory for the new page
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct Page *pp, *old;
+	void *src, *dst;
+	pte_t *pte;
+	int r, perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(pgdir, va, 0);
+	if (pte == NULL || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return -E_INVAL;
+	old = pa2page(PTE_ADDR(*pte));
+	perm = ((*pte & PTE_USER) & ~PTE_COW) | PTE_W;
+
+	if (old == zero_page) {
+		if ((r = page_alloc_high_zero(&pp)) < 0)
+			return r;
+	} else if (old->pp_ref == 1) {
+		*pte = PTE_ADDR(*pte) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	} else {
+		if ((r = page_alloc_high(&pp)) < 0)
+			return r;
+		dst = kmap(pp);
+		src = kmap(old);
+		memmove(dst, src, PGSIZE);
+		kunmap(src);
+		kunmap(dst);
+	}
+
+	// The page table exists, so this cannot fail.
+	r = page_insert(pgdir, pp, va, perm);
+	assert(r == 0);
+	return 0;
 }
 
 //
 // Decrement the reference count on a page,
-// freeing it if there are no more refs.
+// freeing it if there are no more refs.  Pinned pages stay.
 //
 void
 page_decref(struct Page* pp)
 {
+	if (pp->pp_flags & PP_PINNED)
+		return;
 	if (--pp->pp_ref == 0)
 		page_free(pp);
 }
@@ -592,6 +1417,9 @@ page_decref(struct Page* pp)
 //    - Otherwise, pgdir_walk tries to allocate a new page table
 //	with page_alloc.  If this fails, pgdir_walk returns NULL.
 //    - pgdir_walk sets pp_ref to 1 for the new page table.
+//      Its pp_nvalid starts at 0; page_insert() and page_remove()
+//      keep it up to date, and page_remove() frees the table again
+//      once it is empty.
 //    - pgdir_walk clears the new page table.
 //    - Finally, pgdir_walk returns a pointer into the new page table.
 //
@@ -601,28 +1429,33 @@ page_decref(struct Page* pp)
 // Hint 2: the x86 MMU checks permission bits in both the page directory
 // and the page table, so it's safe to leave permissions in the page
 // more permissive than strictly necessary.
+//
+// If 'va' is covered by a 4MB page (PTE_PS set in the PDE), there is no
+// page table and the PDE itself is returned.  Only the kernel's KERNBASE
+// mapping uses 4MB pages.
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	// Attempt to retrieve the page directory entry address.
 	pde_t *pde = &pgdir[PDX(va)];
 
+	if ((*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return (pte_t *) pde;
+
 	// Check if the page table that was addressed by the pde is allocated
 	// and is valid.
 	if((*pde & PTE_P) == 0) {
 		if(create == 0)
 			return NULL;
 
-		// Create a page for the page table.
+		// Create a zeroed page for the page table.
 		struct Page *p;
-		if(page_alloc(&p) != 0)
+		if(page_alloc_zero(&p) != 0)
 			return NULL;
 
 		// Set reference count to 1.
 		p->pp_ref++;
-		
-		// Clear the page table (zero it).
-		memset(KADDR(page2pa(p)), 0, PGSIZE);
+		p->pp_nvalid = 0;
 
 		// Set the pde to the newly created page table.
 		*pde = page2pa(p) | PTE_U | PTE_W | PTE_P;
@@ -663,16 +1496,92 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 		// Page table couldn't be allocated.
 		return -E_NO_MEM;
 
-	pp->pp_ref++;
+	page_incref(pp);
 
-	// If there was something mapped at va, remove it.
-	if( (*pte & PTE_P) != 0)
-		page_remove(pgdir, va);
+	// If there was something mapped at va, remove it.  Not with
+	// page_remove(): the page table must stay, even if that was
+	// its only entry.  A swap entry counts as an entry, too.
+	if( (*pte & PTE_P) != 0) {
+		page_decref(pa2page(PTE_ADDR(*pte)));
+		tlb_invalidate(pgdir, va);
+	} else if (pte_is_swap(*pte))
+		swap_free(PTE_SWAPSLOT(*pte));
+	else
+		pgtable_page(pgdir, va)->pp_nvalid++;
 
 	*pte = page2pa(pp) | perm | PTE_P;
 	return 0;
 }
 
+//
+// Copy the user part of 'srcpgdir' into the empty 'dstpgdir' for fork.
+// Pages that are writable or copy-on-write in the source are mapped
+// copy-on-write in both address spaces; PTE_SHARE pages and read-only
+// pages are simply shared.  The user exception stack is skipped: every
+// environment needs its own.  Swapped-out pages are shared the same
+// way, through their swap slots.
+//
+// This takes one pass over the page tables and bumps pp_ref directly,
+// instead of going through page_insert() for every page.  The pages
+// made read-only in 'srcpgdir' are flushed from the TLB as one batch.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated; the pages mapped
+//     so far stay mapped in 'dstpgdir' and are freed with it.
+//
+int
+pgdir_fork(pde_t *dstpgdir, pde_t *srcpgdir)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *spt, *dpt, pte;
+	struct Tlb_batch tb;
+	int r = 0;
+
+	tlb_batch_begin(&tb);
+	for (pdeno = 0; pdeno < PDX(UTOP) && r == 0; pdeno++) {
+		if (!(srcpgdir[pdeno] & PTE_P))
+			continue;
+		spt = (pte_t *) KADDR(PTE_ADDR(srcpgdir[pdeno]));
+		dpt = NULL;
+
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			pte = spt[pteno];
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if (!(pte & PTE_P) && !pte_is_swap(pte))
+				continue;
+			if (va == UXSTACKTOP - PGSIZE)
+				continue;
+
+			if (dpt == NULL) {
+				if ((dpt = pgdir_walk(dstpgdir, (void *) va, 1)) == NULL) {
+					r = -E_NO_MEM;
+					break;
+				}
+				dpt -= pteno;
+			}
+			pgtable_page(dstpgdir, (void *) va)->pp_nvalid++;
+
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W | PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				if (spt[pteno] != pte) {
+					spt[pteno] = pte;
+					tlb_invalidate(srcpgdir, (void *) va);
+				}
+			}
+			dpt[pteno] = PTE_ADDR(pte) | (pte & PTE_USER);
+			if (pte & PTE_P)
+				page_incref(pa2page(PTE_ADDR(pte)));
+			else
+				swap_dup(PTE_SWAPSLOT(pte));
+		}
+	}
+
+	tlb_batch_flush(&tb);
+	return r;
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -699,6 +1608,20 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
 	}
 }
 
+//
+// Like boot_map_segment, but with 4MB pages.
+// la, size and pa must all be multiples of PTSIZE.
+//
+static void
+boot_map_segment_big(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm)
+{
+	uintptr_t i;
+
+	assert(la % PTSIZE == 0 && size % PTSIZE == 0 && pa % PTSIZE == 0);
+	for (i = 0; i < size; i += PTSIZE)
+		pgdir[PDX(la + i)] = (pa + i) | perm | PTE_PS | PTE_P;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -708,21 +1631,32 @@ boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int per
 //
 // Return NULL if there is no page mapped at va.
 //
+// Within a 4MB mapping, *pte_store is the PDE, and the page returned is
+// the one 'va' falls in, or NULL if that is past the end of memory.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct Page *
 page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
+	physaddr_t pa;
 	pte_t* pte = pgdir_walk(pgdir, va, 0);
-	if(pte == NULL)
+	if(pte == NULL || (*pte & PTE_P) == 0)
 		return NULL;	
 
+	pa = PTE_ADDR(*pte);
+	if (*pte & PTE_PS) {
+		pa += PTX(va) << PTXSHIFT;
+		if (PPN(pa) >= npage)
+			return NULL;
+	}
+
 	// If pte_store is not zero, then we store in it the address
 	// of the pte for this page.
 	if(pte_store != 0)
 		*pte_store = pte;
 
-	return pa2page(*pte);
+	return pa2page(pa);
 }
 
 //
@@ -736,6 +1670,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the pg dir/pg table.
+//   - Below UTOP, a page table left with no entries is freed too.
+//   - A swap entry at 'va' is removed as well.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
@@ -743,33 +1679,221 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	// TODO: Review this code.
 	pte_t* pte = NULL;
 	struct Page* p;
 
 	p = page_lookup(pgdir, va, &pte);
-	if(p == NULL)
+	if(p == NULL) {
+		pte = pgdir_walk(pgdir, va, 0);
+		if (pte != NULL && pte_is_swap(*pte)) {
+			swap_free(PTE_SWAPSLOT(*pte));
+			*pte = 0;
+			pgtable_unref(pgdir, (uintptr_t) va);
+		}
 	  	return;
+	}
 
 	// decrement the ref count for that page
 	page_decref(p);
 	// Set the respective page table entry to 0
-	if(pte != NULL)
-	  	*pte = 0;
+	*pte = 0;
 	// Invalidate tlb
 	tlb_invalidate(pgdir, va);
+
+	pgtable_unref(pgdir, (uintptr_t) va);
+}
+
+//
+// The page table page mapping 'va' in 'pgdir', which must exist.
+//
+static struct Page *
+pgtable_page(pde_t *pgdir, const void *va)
+{
+	return pa2page(PTE_ADDR(pgdir[PDX(va)]));
+}
+
+//
+// One entry of the page table mapping 'va' has been cleared.  If that
+// was its last one and it belongs to the user part of the address
+// space, unhook the table from 'pgdir' and free it.  It was visible
+// at VPT and UVPT, so those mappings are flushed too.
+// Returns 1 if the table was freed.
+//
+static int
+pgtable_unref(pde_t *pgdir, uintptr_t va)
+{
+	struct Page *pt;
+
+	// Kernel page tables are shared by every pgdir; they stay.
+	if (va >= UTOP)
+		return 0;
+
+	pt = pgtable_page(pgdir, (void *) va);
+	assert(pt->pp_nvalid > 0);
+	if (--pt->pp_nvalid > 0)
+		return 0;
+
+	pgdir[PDX(va)] = 0;
+	tlb_invalidate(pgdir, (void *) (VPT + PDX(va) * PGSIZE));
+	tlb_invalidate(pgdir, (void *) (UVPT + PDX(va) * PGSIZE));
+	page_decref(pt);
+	return 1;
+}
+
+//
+// Count the page tables of the user part of 'pgdir' and the pages they
+// map (from the tables' pp_nvalid counts).
+//
+void
+pgdir_usage(pde_t *pgdir, size_t *ntables, size_t *npages)
+{
+	uint32_t pdeno;
+
+	*ntables = *npages = 0;
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++)
+		if (pgdir[pdeno] & PTE_P) {
+			(*ntables)++;
+			*npages += pa2page(PTE_ADDR(pgdir[pdeno]))->pp_nvalid;
+		}
+}
+
+//
+// Unmap every page in [va, va+len), like calling page_remove() on each
+// (swap entries included), but walking the page tables directly and skipping over missing ones.
+// 'va' and 'len' must be page-aligned.  Page tables that end up empty
+// are freed, as by page_remove().  The TLB is flushed once at the end.
+//
+void
+page_remove_range(pde_t *pgdir, uintptr_t va, size_t len)
+{
+	struct Tlb_batch tb;
+	uintptr_t end = va + len;
+	pte_t *pt;
+
+	assert(va % PGSIZE == 0 && len % PGSIZE == 0);
+
+	tlb_batch_begin(&tb);
+	while (va < end) {
+		if (!(pgdir[PDX(va)] & PTE_P)) {
+			va = ROUNDUP(va + 1, PTSIZE);
+			continue;
+		}
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[PDX(va)]));
+		for (; va < end; va += PGSIZE) {
+			if (pt[PTX(va)] & PTE_P)
+				page_decref(pa2page(PTE_ADDR(pt[PTX(va)])));
+			else if (pte_is_swap(pt[PTX(va)]))
+				swap_free(PTE_SWAPSLOT(pt[PTX(va)]));
+			if (pt[PTX(va)] & (PTE_P | PTE_SWAP)) {
+				pt[PTX(va)] = 0;
+				tlb_invalidate(pgdir, (void *) va);
+				if (pgtable_unref(pgdir, va)) {
+					va = ROUNDUP(va + 1, PTSIZE);
+					break;
+				}
+			}
+			if (PTX(va) == NPTENTRIES - 1) {
+				va += PGSIZE;
+				break;
+			}
+		}
+	}
+	tlb_batch_flush(&tb);
+}
+
+//
+// Make every other CPU running in the address space 'pgdir' flush its TLB, and wait until
+// they all have.  We hold the kernel lock, so the flush is done by
+// spin_lock(): a CPU in user mode is called into trap() by an IPI and
+// spins there, and a CPU already in the kernel is spinning or will
+// spin before it next returns to user mode.  Either way it stays out of
+// user mode until we release the lock.  Halted CPUs have no env and
+// flush when they next load one.
+//
+static void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct Cpu *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_env == NULL
+		    || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		c->cpu_tlb_flush = 1;
+		lapic_ipi(c->cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_flush)
+			asm volatile ("pause");
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Inside a TLB batch the entry is only recorded, and flushed later.
+// Other CPUs using the page tables are flushed right away, even inside
+// a batch: they may be running user code, which must not get at a page
+// the batch frees and then hands out again.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	tlb_shootdown(pgdir);
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (tlb_batch == NULL)
+			invlpg(va);
+		else {
+			if (tlb_batch->tb_n == 0)
+				tlb_batch->tb_pgdir = pgdir;
+			else if (tlb_batch->tb_pgdir != pgdir)
+				tlb_batch->tb_pgdir = NULL;
+			if (tlb_batch->tb_n < TLB_BATCH_MAX)
+				tlb_batch->tb_va[tlb_batch->tb_n] = (uintptr_t) va;
+			tlb_batch->tb_n++;
+		}
+	}
+}
+
+//
+// Start collecting TLB invalidations in 'tb' instead of doing them
+// right away.  Until tlb_batch_flush(), nothing may rely on the TLB
+// agreeing with the page tables for the pages changed.  Batches don't
+// nest.
+//
+void
+tlb_batch_begin(struct Tlb_batch *tb)
+{
+	assert(tlb_batch == NULL);
+	tb->tb_pgdir = NULL;
+	tb->tb_n = 0;
+	tlb_batch = tb;
+}
+
+//
+// End the batch 'tb' and flush what it collected: page by page if
+// there were at most TLB_BATCH_MAX pages, else the whole TLB.  Nothing
+// is flushed if the address space changed is no longer loaded (as in
+// env_free, which switches to boot_pgdir first).
+//
+void
+tlb_batch_flush(struct Tlb_batch *tb)
+{
+	uint32_t i;
+
+	assert(tlb_batch == tb);
+	tlb_batch = NULL;
+
+	if (tb->tb_n == 0)
+		return;
+	if (tb->tb_pgdir && rcr3() != PADDR(tb->tb_pgdir))
+		return;
+	if (tb->tb_n <= TLB_BATCH_MAX)
+		for (i = 0; i < tb->tb_n; i++)
+			invlpg((void *) tb->tb_va[i]);
+	else
+		lcr3(rcr3());
 }
 
 static uintptr_t user_mem_check_addr;
@@ -803,7 +1927,16 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	uintptr_t evp = PPN(eva) <<PGSHIFT;
 
 	for (; svp <= evp; svp += PGSIZE) {
-		pte_t *ppte = pgdir_walk(env->env_pgdir, (void *) svp, 0);
+		pte_t *ppte;
+
+		// Swapped-out pages are brought back first; this might
+		// not return, but restart the system call later.
+		swap_wait(env, (void *) svp);
+		ppte = pgdir_walk(env->env_pgdir, (void *) svp, 0);
+
+		// A write to a copy-on-write page is fine: copy it now.
+		if ((perm & PTE_W) && ppte != NULL && (*ppte & PTE_COW))
+			page_cow_fault(env->env_pgdir, (void *) svp);
 
 		if ((ppte != NULL) && ((*ppte & (perm | PTE_P)) == (perm | PTE_P)))
 			continue;
@@ -857,8 +1990,7 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	check_drain(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -929,15 +2061,19 @@ page_check(void)
 	assert(pp1->pp_ref == 1);
 	assert(pp2->pp_ref == 0);
 
-	// unmapping pp1 at PGSIZE should free it
+	// unmapping pp1 at PGSIZE should free it, and the page table,
+	// which is empty now
 	page_remove(boot_pgdir, (void*) PGSIZE);
 	assert(check_va2pa(boot_pgdir, 0x0) == ~0);
 	assert(check_va2pa(boot_pgdir, PGSIZE) == ~0);
+	assert(boot_pgdir[0] == 0);
+	assert(pp0->pp_ref == 0);
 	assert(pp1->pp_ref == 0);
 	assert(pp2->pp_ref == 0);
 
-	// so it should be returned by page_alloc
-	assert(page_alloc(&pp) == 0 && pp == pp1);
+	// so both should be returned by page_alloc
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp1));
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp1));
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -958,12 +2094,6 @@ page_check(void)
 	assert(pp2->pp_ref == 0);
 #endif
 
-	// forcibly take pp0 back
-	assert(PTE_ADDR(boot_pgdir[0]) == page2pa(pp0));
-	boot_pgdir[0] = 0;
-	assert(pp0->pp_ref == 1);
-	pp0->pp_ref = 0;
-	
 	// check pointer arithmetic in pgdir_walk
 	page_free(pp0);
 	va = (void*)(PGSIZE * NPDENTRIES + PGSIZE);
@@ -983,8 +2113,28 @@ page_check(void)
 	boot_pgdir[0] = 0;
 	pp0->pp_ref = 0;
 
+	// page_remove_range should unmap the range and nothing else
+	page_free(pp0);
+	assert(page_insert(boot_pgdir, pp1, 0x0, 0) == 0);
+	assert(page_insert(boot_pgdir, pp2, (void*) (2*PGSIZE), 0) == 0);
+	assert(page_insert(boot_pgdir, pp2, (void*) (5*PGSIZE), 0) == 0);
+	assert(PTE_ADDR(boot_pgdir[0]) == page2pa(pp0));
+	page_remove_range(boot_pgdir, 0, 4*PGSIZE);
+	assert(check_va2pa(boot_pgdir, 0x0) == ~0);
+	assert(check_va2pa(boot_pgdir, 2*PGSIZE) == ~0);
+	assert(check_va2pa(boot_pgdir, 5*PGSIZE) == page2pa(pp2));
+	assert(pp1->pp_ref == 0 && pp2->pp_ref == 1);
+	assert(page_alloc(&pp) == 0 && pp == pp1);
+	// ... also across a missing page table, freeing the empty one
+	page_remove_range(boot_pgdir, 0, 2*PTSIZE);
+	assert(check_va2pa(boot_pgdir, 5*PGSIZE) == ~0);
+	assert(boot_pgdir[0] == 0);
+	assert(pp0->pp_ref == 0 && pp2->pp_ref == 0);
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp2));
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp2));
+
 	// give free list back
-	page_free_list = fl;
+	check_refill(&fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -30,17 +30,25 @@ struct Env;
 ({								\
 	physaddr_t __m_pa = (pa);				\
 	uint32_t __m_ppn = PPN(__m_pa);				\
-	if (__m_ppn >= npage)					\
+	if (__m_ppn >= npage_low)				\
 		panic("KADDR called with invalid pa %08lx", __m_pa);\
 	(void*) (__m_pa + KERNBASE);				\
 })
 
 
 
+#ifndef JOS_BIGPAGES
+// Map the physical memory window at KERNBASE with 4MB PSE pages and mark
+// kernel mappings global, when the CPU supports it.  Set to 0 to get the
+// old all-4KB, non-global kernel mappings (e.g. to compare benchmarks).
+#define JOS_BIGPAGES 1
+#endif
+
 extern char bootstacktop[], bootstack[];
 
 extern struct Page *pages;
 extern size_t npage;
+extern size_t npage_low;
 
 extern physaddr_t boot_cr3;
 extern pde_t *boot_pgdir;
@@ -51,16 +59,66 @@ extern struct Pseudodesc gdt_pd;
 void	i386_vm_init();
 void	i386_detect_memory();
 
+// The physical page allocator is a binary buddy allocator.  A block of
+// order 'o' is 2^o physically contiguous pages, aligned to its size.
+#define BUDDY_MAX_ORDER	10		// 4MB: one PSE superpage
+#define BUDDY_NORDER	(BUDDY_MAX_ORDER + 1)
+
 void	page_init(void);
 int	page_alloc(struct Page **pp_store);
+int	page_alloc_order(struct Page **pp_store, int order);
+int	page_alloc_high(struct Page **pp_store);
+int	page_alloc_high_zero(struct Page **pp_store);
 void	page_free(struct Page *pp);
+void	page_free_order(struct Page *pp, int order);
+uint32_t page_free_count(void);
+
+// Pool of pre-zeroed pages, refilled while the system is idle.
+#define ZPOOL_MAX	64		// pages kept zeroed in advance
+#define ZPOOL_BATCH	8		// pages zeroed per refill
+
+int	page_alloc_zero(struct Page **pp_store);
+void	page_zero_refill(void);
+void	page_zero_print_stats(void);
+
+// Demand-zero pages: mapped to one shared, read-only page of zeros
+// until the first write.
+int	page_map_zero(pde_t *pgdir, void *va, int perm);
+// Give a PTE_COW mapping (demand-zero or shared) a writable page.
+int	page_cow_fault(pde_t *pgdir, void *va);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
+int	pgdir_fork(pde_t *dstpgdir, pde_t *srcpgdir);
 void	page_remove(pde_t *pgdir, void *va);
+void	page_remove_range(pde_t *pgdir, uintptr_t va, size_t len);
+void	pgdir_usage(pde_t *pgdir, size_t *ntables, size_t *npages);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
+// Temporary kernel mappings of highmem pages
+void	*kmap(struct Page *pp);
+void	kunmap(void *va);
+
+// Uncached mappings of device memory (the local APIC), above KERNBASE
+void	*mmio_map_region(physaddr_t pa, size_t size);
+void	pmap_init_percpu(void);
+extern uint32_t mpentry_cr4;
+
+// TLB invalidations collected between tlb_batch_begin() and
+// tlb_batch_flush().  Up to TLB_BATCH_MAX pages are flushed one by one
+// with invlpg; past that, reloading cr3 is cheaper.
+#define TLB_BATCH_MAX	32
+
+struct Tlb_batch {
+	pde_t *tb_pgdir;		// address space the pages belong to
+	uint32_t tb_n;			// pages invalidated so far
+	uintptr_t tb_va[TLB_BATCH_MAX];	// the first TLB_BATCH_MAX of them
+};
+
+void	tlb_batch_begin(struct Tlb_batch *tb);
+void	tlb_batch_flush(struct Tlb_batch *tb);
+
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 
@@ -94,6 +152,74 @@ page2kva(struct Page *pp)
 	return KADDR(page2pa(pp));
 }
 
+// Count one more reference to 'pp'.  Pinned pages aren't counted.
+static inline void
+page_incref(struct Page *pp)
+{
+	if (!(pp->pp_flags & PP_PINNED))
+		pp->pp_ref++;
+}
+
+// Is 'pp' above the KERNBASE mapping, so only reachable through kmap()?
+static inline bool
+page_is_high(struct Page *pp)
+{
+	return page2ppn(pp) >= npage_low;
+}
+
+// Lists of pages, linked by page number through pp_link.
+
+static inline void
+page_list_init(struct Page_list *l)
+{
+	l->pl_first = PP_NIL;
+}
+
+static inline bool
+page_list_empty(struct Page_list *l)
+{
+	return l->pl_first == PP_NIL;
+}
+
+static inline struct Page *
+page_list_first(struct Page_list *l)
+{
+	return l->pl_first == PP_NIL ? NULL : &pages[l->pl_first];
+}
+
+static inline struct Page *
+page_list_next(struct Page *pp)
+{
+	return pp->pp_link.pl_next == PP_NIL ? NULL : &pages[pp->pp_link.pl_next];
+}
+
+static inline void
+page_list_insert_head(struct Page_list *l, struct Page *pp)
+{
+	pp->pp_link.pl_next = l->pl_first;
+	pp->pp_link.pl_prev = PP_NIL;
+	if (l->pl_first != PP_NIL)
+		pages[l->pl_first].pp_link.pl_prev = page2ppn(pp);
+	l->pl_first = page2ppn(pp);
+}
+
+// Remove 'pp' from 'l', the list it is on.
+static inline void
+page_list_remove(struct Page_list *l, struct Page *pp)
+{
+	uint32_t next = pp->pp_link.pl_next, prev = pp->pp_link.pl_prev;
+
+	if (prev == PP_NIL)
+		l->pl_first = next;
+	else
+		pages[prev].pp_link.pl_next = next;
+	if (next != PP_NIL)
+		pages[next].pp_link.pl_prev = prev;
+}
+
+#define PAGE_LIST_FOREACH(pp, l) \
+	for ((pp) = page_list_first(l); (pp); (pp) = page_list_next(pp))
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 // Challege 2:
@@ -1,41 +1,502 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
 
 
+#if JOS_STRIDE
+#define SCHED_NQUEUE	1
+#define sched_queue(e)	0
+#elif JOS_MLFQ
+#define SCHED_NQUEUE	MLFQ_NLEVEL
+#define sched_queue(e)	((e)->env_level)
+#else
+#define SCHED_NQUEUE	ENV_NPRIO
+#define sched_queue(e)	((e)->env_priority)
+#endif
+
+// The runnable environments other than the idle one.  Every CPU has a
+// queue per priority (or MLFQ level), each in the order its
+// environments get that CPU; an environment is on the queues of CPU
+// env_rqcpu.  env_set_status() and env_set_priority() keep them up to
+// date.
+static struct Env_tailq sched_runq[NCPU][SCHED_NQUEUE];
+static uint32_t sched_nqueued[NCPU];	// environments on each CPU's queues
+
+#if JOS_STRIDE
+// The pass of the environment that got each CPU last.  Environments
+// that become runnable start no earlier, so time spent blocked is not
+// saved up for later.
+static uint64_t stride_pass[NCPU];
+#endif
+
+#if JOS_MLFQ
+static const uint32_t mlfq_quanta[MLFQ_NLEVEL] = MLFQ_QUANTA;
+#endif
+
+// Statistics for the monitor
+static uint32_t sched_queue_ticks[SCHED_NQUEUE];	// ticks run per queue
+static uint32_t sched_idle_ticks;
+static uint32_t sched_ndemote;
+static uint32_t sched_nboost;
+static uint32_t sched_nreset;
+static uint32_t sched_nticks;
+static uint32_t sched_nsteal[NCPU];	// environments each CPU stole
+
+void
+sched_init(void)
+{
+	int c, i;
+
+	for (c = 0; c < NCPU; c++)
+		for (i = 0; i < SCHED_NQUEUE; i++)
+			TAILQ_INIT(&sched_runq[c][i]);
+}
+
+//
+// A halted CPU has its tick stopped, so it only looks at the run queues
+// again when another CPU wakes it up.  'e' was just queued: wake up its
+// CPU if that is halted, or else, if its CPU already has other work, a
+// halted CPU that may run 'e', to steal it.
+//
+static void
+sched_wakeup(struct Env *e)
+{
+	int c = e->env_rqcpu, i;
+
+	if (!JOS_IDLE_HALT || ncpu == 1)
+		return;
+	if (c != cpunum() && cpus[c].cpu_status == CPU_HALTED) {
+		lapic_ipi(cpus[c].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+		return;
+	}
+	if (sched_nqueued[c] < 2)
+		return;
+	for (i = 0; i < ncpu; i++)
+		if (i != c && i != cpunum() && cpus[i].cpu_status == CPU_HALTED
+		    && (e->env_affinity & (1 << i))) {
+			lapic_ipi(cpus[i].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+			return;
+		}
+}
+
+// 'e' has become runnable: it goes to the back of its run queue, on
+// the CPU it last ran on if its affinity still allows that.
+void
+sched_enqueue(struct Env *e)
+{
+	int c;
+
+	if (e == &envs[0])
+		return;
+	if (e->env_rqcpu < 0 || e->env_rqcpu >= ncpu
+	    || !(e->env_affinity & (1 << e->env_rqcpu))) {
+		for (c = 0; c < ncpu - 1; c++)
+			if (e->env_affinity & (1 << c))
+				break;
+		e->env_rqcpu = c;
+	}
+#if JOS_STRIDE
+	if ((int64_t) (e->env_pass - stride_pass[e->env_rqcpu]) < 0)
+		e->env_pass = stride_pass[e->env_rqcpu];
+#endif
+	TAILQ_INSERT_TAIL(&sched_runq[e->env_rqcpu][sched_queue(e)], e, env_runq);
+	sched_nqueued[e->env_rqcpu]++;
+	sched_wakeup(e);
+}
+
+// 'e' is no longer runnable.
+void
+sched_dequeue(struct Env *e)
+{
+	if (e == &envs[0])
+		return;
+	TAILQ_REMOVE(&sched_runq[e->env_rqcpu][sched_queue(e)], e, env_runq);
+	sched_nqueued[e->env_rqcpu]--;
+}
+
+//
+// Move runnable 'e' to the run queues of CPU 'cpu', counting a
+// migration.
+//
+static void
+sched_migrate(struct Env *e, int cpu)
+{
+	sched_dequeue(e);
+	e->env_rqcpu = cpu;
+	sched_enqueue(e);
+	e->env_migrations++;
+}
+
+//
+// Restrict 'e' to the CPUs in 'mask' (bit i for CPU i), which must
+// include a CPU that exists.  If it is queued on a CPU outside the
+// mask, it moves.
+//
+void
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	e->env_affinity = mask;
+	if (e == &envs[0] || e->env_rqcpu < 0 || (mask & (1 << e->env_rqcpu)))
+		return;
+	if (e->env_status == ENV_RUNNABLE)
+		sched_migrate(e, e->env_rqcpu);	// sched_enqueue() picks the CPU
+	else
+		e->env_rqcpu = -1;
+}
+
+#if JOS_MLFQ
+// Move 'e' to MLFQ level 'level', with a fresh quantum.
+static void
+mlfq_set_level(struct Env *e, uint32_t level)
+{
+	if (e->env_status == ENV_RUNNABLE) {
+		sched_dequeue(e);
+		e->env_level = level;
+		sched_enqueue(e);
+	} else
+		e->env_level = level;
+	e->env_ticks = 0;
+}
+
+// Is an environment above MLFQ level 'level' waiting to run here?
+static bool
+mlfq_higher_runnable(uint32_t level)
+{
+	while (++level < MLFQ_NLEVEL)
+		if (!TAILQ_EMPTY(&sched_runq[cpunum()][level]))
+			return 1;
+	return 0;
+}
+
+// Put every environment back on the top level, so that those that were
+// demoted cannot be starved for good.
+static void
+mlfq_reset(void)
+{
+	struct Env *e;
+
+	for (e = envs + 1; e < envs + NENV; e++)
+		if (e->env_status != ENV_FREE)
+			mlfq_set_level(e, MLFQ_NLEVEL - 1);
+	sched_nreset++;
+}
+#endif
+
+//
+// 'e' is about to block waiting for a message.  Under the MLFQ, if it
+// has not used up its quantum, it goes up a level.
+//
+void
+sched_boost(struct Env *e)
+{
+#if JOS_MLFQ
+	if (e == &envs[0] || e->env_ticks >= mlfq_quanta[e->env_level])
+		return;
+	if (e->env_level < MLFQ_NLEVEL - 1) {
+		mlfq_set_level(e, e->env_level + 1);
+		sched_nboost++;
+	} else
+		e->env_ticks = 0;
+#endif
+}
+
+//
+// 'e' ran for 'cycles' TSC cycles, counting the time the kernel spent on
+// its behalf.
+//
+void
+sched_charge(struct Env *e, uint64_t cycles)
+{
+	e->env_cycles += cycles;
+#if JOS_STRIDE
+	e->env_pass += cycles * (STRIDE1 / e->env_tickets);
+#endif
+}
+
+//
+// A timer tick while 'curenv' ran in user mode.  With static
+// priorities, every tick preempts it.  Under the MLFQ, it keeps the
+// CPU until it has used the quantum of its level, which demotes it, or
+// an environment of a higher level becomes runnable.
+//
+void
+sched_tick(void)
+{
+	struct Env *e = curenv;
+
+	sched_nticks++;
+	if (e == &envs[0]) {
+		sched_idle_ticks++;
+		sched_yield();
+	}
+	sched_queue_ticks[sched_queue(e)]++;
+
+#if JOS_MLFQ
+	if (sched_nticks % MLFQ_RESET == 0)
+		mlfq_reset();
+	if (++e->env_ticks >= mlfq_quanta[e->env_level]) {
+		if (e->env_level > 0) {
+			mlfq_set_level(e, e->env_level - 1);
+			sched_ndemote++;
+		} else
+			e->env_ticks = 0;
+	} else if (!mlfq_higher_runnable(e->env_level))
+		return;
+#endif
+	sched_yield();
+}
+
+void
+sched_print_stats(void)
+{
+	struct Cpu *c;
+	uint64_t now, idle, total;
+	int i;
+
+#if JOS_MLFQ
+	cprintf("mlfq: %d levels, reset every %d ticks\n",
+		MLFQ_NLEVEL, MLFQ_RESET);
+	for (i = MLFQ_NLEVEL - 1; i >= 0; i--)
+		cprintf("  level %d: quantum %d, %d ticks\n",
+			i, mlfq_quanta[i], sched_queue_ticks[i]);
+	cprintf("%d demotions, %d boosts, %d resets\n",
+		sched_ndemote, sched_nboost, sched_nreset);
+#elif JOS_STRIDE
+	cprintf("stride scheduling\n");
+#else
+	cprintf("static priorities\n");
+	for (i = ENV_NPRIO - 1; i >= 0; i--)
+		cprintf("  priority %d: %d ticks\n", i, sched_queue_ticks[i]);
+#endif
+	cprintf("idle: %d of %d ticks\n", sched_idle_ticks, sched_nticks);
+	now = read_tsc();
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		idle = c->cpu_idle_cycles;
+		if (c->cpu_status == CPU_HALTED)
+			idle += now - c->cpu_idle_tsc;
+		total = now - c->cpu_boot_tsc;
+		cprintf("  cpu %d: %d queued, %d stolen, idle %u.%u%% (%u halts)\n",
+			i, sched_nqueued[i], sched_nsteal[i],
+			(uint32_t) (total ? idle * 100 / total : 0),
+			(uint32_t) (total ? idle * 1000 / total % 10 : 0),
+			c->cpu_nhalt);
+	}
+}
+
+//
+// Show what share of the CPU each environment got, by times run and by
+// TSC cycles, next to the share its tickets entitle it to among all
+// live environments.  Shares are in tenths of a percent.
+//
+void
+sched_print_shares(void)
+{
+	struct Env *e;
+	uint64_t cycles = 0;
+	uint32_t runs = 0, tickets = 0;
+
+	for (e = envs + 1; e < envs + NENV; e++)
+		if (e->env_status != ENV_FREE) {
+			cycles += e->env_cycles;
+			runs += e->env_runs;
+			tickets += e->env_tickets;
+		}
+	if (cycles == 0 || runs == 0)
+		return;
+
+	cprintf("env       tickets  entitled  runs      by runs  by cycles\n");
+	for (e = envs + 1; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		cprintf("%08x  %-7u  %-8u  %-8u  %-7u  %u\n",
+			e->env_id, e->env_tickets,
+			e->env_tickets * 1000 / tickets, e->env_runs,
+			(uint32_t) ((uint64_t) e->env_runs * 1000 / runs),
+			(uint32_t) (e->env_cycles * 1000 / cycles));
+	}
+}
+
+// Can this CPU run 'e'?  Not if it is current on another CPU.
+static inline bool
+sched_can_run(struct Env *e)
+{
+	return e->env_cpunum < 0 || e->env_cpunum == cpunum();
+}
+
+//
+// This CPU has nothing of its own to run: move a runnable environment
+// that may run here from the sibling CPU with the most environments
+// queued, taking the highest-priority one.  Returns NULL if no sibling
+// has one to spare.
+//
+static struct Env *
+sched_steal(void)
+{
+	struct Env *e, *victim = NULL;
+	int c, q, me = cpunum(), busiest = -1;
+
+	for (c = 0; c < ncpu; c++) {
+		if (c == me || (busiest >= 0
+				&& sched_nqueued[c] <= sched_nqueued[busiest]))
+			continue;
+		for (q = SCHED_NQUEUE - 1; q >= 0; q--) {
+			TAILQ_FOREACH(e, &sched_runq[c][q], env_runq)
+				if (sched_can_run(e)
+				    && (e->env_affinity & (1 << me)))
+					break;
+			if (e)
+				break;
+		}
+		if (e) {
+			victim = e;
+			busiest = c;
+		}
+	}
+	if (victim) {
+		sched_migrate(victim, me);
+		sched_nsteal[me]++;
+	}
+	return victim;
+}
+
+//
+// Nothing for this CPU to run: give up the kernel lock and halt until
+// the next interrupt, which goes back through trap().
+//
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+	int i;
+
+	// Only the boot CPU drops into the monitor, once no CPU has an
+	// environment queued or running and there is nothing left to do.
+	// (envs[0], the idle environment, is never queued.)
+	if (thiscpu == bootcpu) {
+		for (i = 0; i < ncpu; i++)
+			if (sched_nqueued[i] > 0 || (&cpus[i] != thiscpu
+						     && cpus[i].cpu_env != NULL))
+				break;
+		if (i == ncpu) {
+			cprintf("Destroyed all environments - nothing more to do!\n");
+			while (1)
+				monitor(NULL);
+		}
+	}
+
+	if (curenv)
+		curenv->env_cpunum = -1;
+	curenv = NULL;
+	lcr3(boot_cr3);
+
+#if JOS_IDLE_HALT
+	// Only the boot CPU has a deadline: the next round of idle work.
+	lapic_timer_idle(thiscpu == bootcpu ? IDLE_TICKS : 0);
+#endif
+	thiscpu->cpu_nhalt++;
+	thiscpu->cpu_idle_tsc = read_tsc();
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	unlock_kernel();
+
+	// Reset the stack pointer, enable interrupts and halt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: hlt returned");
+}
+
+//
+// Called by trap() when an interrupt wakes up this CPU from
+// sched_halt(): account for the time it slept, and restart its tick.
+//
+void
+sched_idle_end(void)
+{
+	thiscpu->cpu_idle_cycles += read_tsc() - thiscpu->cpu_idle_tsc;
+#if JOS_IDLE_HALT
+	lapic_timer_resume();
+#endif
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	// Search through 'envs' for a runnable environment,
-	// in circular fashion starting after the previously running env,
-	// and switch to the first such environment found.
-	// It's OK to choose the previously running env if no other env
-	// is runnable.
-	// But never choose envs[0], the idle environment,
+	// Never choose envs[0], the idle environment,
 	// unless NOTHING else is runnable.
+	struct Env *e;
+	int me = cpunum(), idled = 0;
+#if JOS_STRIDE
+	struct Env *best;
 
-	// LAB 4:
-	static int prev_env = 0;
-	int i;
-	int new_env = 0;
-	for (i = 1; i <= NENV; i++) {
-		new_env = (prev_env + i) % NENV;
-		if (new_env != 0 && envs[new_env].env_status == ENV_RUNNABLE) {
-			prev_env = new_env;			
-			env_run(&envs[new_env]);
-		}
+again:
+	// Run the runnable environment on this CPU's queue that is
+	// furthest behind, or one from a busier CPU.
+	best = NULL;
+	TAILQ_FOREACH(e, &sched_runq[me][0], env_runq)
+		if (sched_can_run(e) && (!best
+		    || (int64_t) (e->env_pass - best->env_pass) < 0))
+			best = e;
+	if (best || (best = sched_steal())) {
+		stride_pass[me] = best->env_pass;
+		env_run(best);
 	}
+#else
+	int q;
 
-	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE)
-		env_run(&envs[0]);
-	else {
-		cprintf("Destroyed all environments - nothing more to do!\n");
-		while (1)
-			monitor(NULL);
+again:
+	// Run the first environment this CPU can run in its
+	// highest-priority run queue that has one, and move it to the
+	// back: round-robin within a priority.  This is the previously
+	// running env only if nothing else of its priority is runnable.
+	for (q = SCHED_NQUEUE - 1; q >= 0; q--)
+		TAILQ_FOREACH(e, &sched_runq[me][q], env_runq)
+			if (sched_can_run(e)) {
+				TAILQ_REMOVE(&sched_runq[me][q], e, env_runq);
+				TAILQ_INSERT_TAIL(&sched_runq[me][q], e, env_runq);
+				env_run(e);
+			}
+	// Nothing here: take work from a busier CPU.
+	if ((e = sched_steal()) != NULL)
+		env_run(e);
+#endif
+
+	// Nothing else is runnable.  Use the spare time to zero some pages
+	// ahead of time, to merge identical pages, and to start swapping if
+	// memory is getting short.
+	swap_idle();
+	ksm_idle();
+	page_zero_refill();
+
+	// That may have queued something here (swap_kick() wakes the pager
+	// onto this CPU, and sched_wakeup() never wakes the CPU doing the
+	// queueing), so look again before halting.
+	if (!idled && sched_nqueued[me] > 0) {
+		idled = 1;
+		goto again;
 	}
+
+#if !JOS_IDLE_HALT
+	// Run the special idle environment.  Only one CPU can run it; the
+	// others halt.
+	if (envs[0].env_status == ENV_RUNNABLE && sched_can_run(&envs[0]))
+		env_run(&envs[0]);
+#endif
+	sched_halt();
 }
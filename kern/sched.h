@@ -6,6 +6,76 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#ifndef JOS_MLFQ
+// Schedule with a multi-level feedback queue instead of by the static
+// priorities of sys_env_set_priority().  An environment starts at the
+// top level, moves down a level each time it uses up the quantum of its
+// level, and up a level when it blocks in sys_ipc_recv() before that.
+// Every MLFQ_RESET ticks everything goes back to the top.
+#define JOS_MLFQ 0
+#endif
+
+#ifndef JOS_STRIDE
+// Schedule by stride scheduling instead: every environment gets a share
+// of the CPU time in proportion to its tickets (sys_env_set_tickets()).
+// Each runs in turn in order of its pass, a virtual time that advances
+// by STRIDE1 / tickets per TSC cycle it is charged.
+#define JOS_STRIDE 0
+#endif
+
+#ifndef JOS_IDLE_HALT
+// With nothing to run, halt the CPU in the kernel, with its periodic
+// tick stopped, instead of running the idle environment (user/idle),
+// which spins in sys_yield().  Set to 0 to get the idle environment
+// back (e.g. to compare).
+#define JOS_IDLE_HALT 1
+#endif
+
+#ifndef IDLE_TICKS
+// While the system is idle, the boot CPU wakes up every IDLE_TICKS
+// ticks for a round of idle work (zeroing pages, KSM, swapping).  The
+// other CPUs sleep until an IPI gives them something to run.
+#define IDLE_TICKS	10
+#endif
+
+#if JOS_MLFQ && JOS_STRIDE
+# error "JOS_MLFQ and JOS_STRIDE are alternatives"
+#endif
+
+#define STRIDE1		(1 << 20)
+
+#ifndef MLFQ_NLEVEL
+#define MLFQ_NLEVEL	4
+#endif
+
+#ifndef MLFQ_QUANTA
+// Timer ticks an environment may use at each level before it is
+// demoted, from the bottom level up.
+#define MLFQ_QUANTA	{ 8, 4, 2, 1 }
+#endif
+
+#ifndef MLFQ_RESET
+#define MLFQ_RESET	100
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_affinity(struct Env *e, uint32_t mask);
+void sched_boost(struct Env *e);
+void sched_charge(struct Env *e, uint64_t cycles);
+void sched_idle_end(void);
+void sched_print_stats(void);
+void sched_print_shares(void);
+
+// Called on every timer interrupt from user mode.  Does not return if
+// the current environment is preempted.
+void sched_tick(void);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
@@ -0,0 +1,198 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/shm.h>
+
+static struct Shm_region shm_regions[SHM_MAX];
+static uint32_t shm_gen;		// generation for the next sh_id
+
+#define SHMX(shmid)	((shmid) & 0xFF)
+
+static struct Shm_region *
+shm_lookup(int32_t shmid)
+{
+	struct Shm_region *sh;
+
+	if (shmid < 0 || SHMX(shmid) >= SHM_MAX)
+		return NULL;
+	sh = &shm_regions[SHMX(shmid)];
+	if (sh->sh_name[0] == '\0' || sh->sh_id != shmid)
+		return NULL;
+	return sh;
+}
+
+static void
+shm_free(struct Shm_region *sh, uint32_t npages)
+{
+	uint32_t i;
+
+	for (i = 0; i < npages; i++)
+		page_decref(sh->sh_pages[i]);
+	kfree(sh->sh_pages);
+	sh->sh_pages = NULL;
+	sh->sh_name[0] = '\0';
+}
+
+//
+// Look up the region called 'name', or with SHM_CREATE in 'flags',
+// create it with 'npages' zeroed pages if there is none.
+//
+// RETURNS:
+//   the region's id, on success
+//   -E_NOT_FOUND, if there is no such region and SHM_CREATE is not set
+//   -E_INVAL, if the region has fewer than 'npages' pages, or 'name'
+//     is empty, or 'npages' is 0 or more than SHM_MAXPAGES
+//   -E_MAX_OPEN, if there are SHM_MAX regions already
+//   -E_NO_MEM, if there is no memory for the pages
+//
+int
+shm_open(const char *name, uint32_t npages, int flags)
+{
+	struct Shm_region *sh, *freesh = NULL;
+	struct Page *pp;
+	uint32_t i;
+
+	if (name[0] == '\0' || strlen(name) >= SHM_NAMELEN)
+		return -E_INVAL;
+	for (sh = shm_regions; sh < shm_regions + SHM_MAX; sh++) {
+		if (sh->sh_name[0] == '\0') {
+			if (!freesh)
+				freesh = sh;
+		} else if (strcmp(sh->sh_name, name) == 0)
+			return npages <= sh->sh_npages ? sh->sh_id : -E_INVAL;
+	}
+
+	if (!(flags & SHM_CREATE))
+		return -E_NOT_FOUND;
+	if (npages == 0 || npages > SHM_MAXPAGES)
+		return -E_INVAL;
+	if ((sh = freesh) == NULL)
+		return -E_MAX_OPEN;
+
+	if ((sh->sh_pages = kmalloc(npages * sizeof(struct Page *))) == NULL)
+		return -E_NO_MEM;
+	for (i = 0; i < npages; i++) {
+		if (page_alloc_high_zero(&pp) < 0) {
+			shm_free(sh, i);
+			return -E_NO_MEM;
+		}
+		pp->pp_ref++;
+		sh->sh_pages[i] = pp;
+	}
+
+	strcpy(sh->sh_name, name);
+	sh->sh_npages = npages;
+	sh->sh_id = ((++shm_gen & 0x7FFFFF) << 8) | (sh - shm_regions);
+	return sh->sh_id;
+}
+
+//
+// Unmap the pages of region 'shmid' mapped at 'va' in 'e'.  Other
+// pages in that range are left alone.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'shmid' is not a region, or the region wouldn't fit
+//     at 'va' below UTOP, or 'va' is not page-aligned
+//
+int
+shm_detach(struct Env *e, int32_t shmid, void *va)
+{
+	struct Shm_region *sh;
+	struct Tlb_batch tb;
+	uint32_t i;
+	char *a;
+
+	if ((sh = shm_lookup(shmid)) == NULL)
+		return -E_INVAL;
+	if ((uintptr_t) va % PGSIZE != 0 || (uintptr_t) va >= UTOP
+	    || sh->sh_npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+
+	tlb_batch_begin(&tb);
+	for (i = 0, a = va; i < sh->sh_npages; i++, a += PGSIZE)
+		if (page_lookup(e->env_pgdir, a, NULL) == sh->sh_pages[i])
+			page_remove(e->env_pgdir, a);
+	tlb_batch_flush(&tb);
+	return 0;
+}
+
+//
+// Map every page of region 'shmid' into 'e', starting at 'va', with
+// 'perm' plus PTE_SHARE, so that fork and spawn share them too.
+// Whatever was mapped there before is unmapped.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, like for shm_detach()
+//   -E_NO_MEM, if a page table couldn't be allocated; nothing of the
+//     region is mapped then
+//
+int
+shm_attach(struct Env *e, int32_t shmid, void *va, int perm)
+{
+	struct Shm_region *sh;
+	struct Tlb_batch tb;
+	uint32_t i;
+	char *a;
+
+	if ((sh = shm_lookup(shmid)) == NULL)
+		return -E_INVAL;
+	if ((uintptr_t) va % PGSIZE != 0 || (uintptr_t) va >= UTOP
+	    || sh->sh_npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+
+	tlb_batch_begin(&tb);
+	for (i = 0, a = va; i < sh->sh_npages; i++, a += PGSIZE)
+		if (page_insert(e->env_pgdir, sh->sh_pages[i], a,
+				perm | PTE_SHARE) < 0)
+			break;
+	tlb_batch_flush(&tb);
+
+	if (i < sh->sh_npages) {
+		shm_detach(e, shmid, va);
+		return -E_NO_MEM;
+	}
+	return 0;
+}
+
+//
+// Remove the name of region 'shmid'.  Its pages are freed once nobody
+// maps them any more.  Returns 0, or -E_INVAL if there is no such
+// region.
+//
+int
+shm_remove(int32_t shmid)
+{
+	struct Shm_region *sh;
+
+	if ((sh = shm_lookup(shmid)) == NULL)
+		return -E_INVAL;
+	shm_free(sh, sh->sh_npages);
+	return 0;
+}
+
+void
+shm_print_stats(void)
+{
+	struct Shm_region *sh;
+	uint32_t i, nmaps;
+
+	cprintf("region                            id        pages  mappings\n");
+	for (sh = shm_regions; sh < shm_regions + SHM_MAX; sh++) {
+		if (sh->sh_name[0] == '\0')
+			continue;
+		nmaps = 0;
+		for (i = 0; i < sh->sh_npages; i++)
+			nmaps += sh->sh_pages[i]->pp_ref - 1;
+		cprintf("%-32s  %08x  %-5u  %u\n",
+			sh->sh_name, sh->sh_id, sh->sh_npages, nmaps);
+	}
+}
@@ -0,0 +1,38 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SHM_H
+#define JOS_KERN_SHM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/syscall.h>
+
+struct Env;
+struct Page;
+
+// Named shared memory regions.
+//
+// A region is a set of zeroed pages with a name, which any environment
+// can look up and map into its address space, without the help of the
+// environment that created it.  The region holds a reference to each of
+// its pages, and every mapping holds another, so removing the name only
+// frees the pages once the last environment has unmapped them.
+
+#define SHM_MAX		64		// regions at once
+
+struct Shm_region {
+	char sh_name[SHM_NAMELEN];	// empty if the entry is free
+	int32_t sh_id;			// generation and index
+	uint32_t sh_npages;
+	struct Page **sh_pages;
+};
+
+int	shm_open(const char *name, uint32_t npages, int flags);
+int	shm_attach(struct Env *e, int32_t shmid, void *va, int perm);
+int	shm_detach(struct Env *e, int32_t shmid, void *va);
+int	shm_remove(int32_t shmid);
+void	shm_print_stats(void);
+
+#endif	// !JOS_KERN_SHM_H
@@ -0,0 +1,70 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// The big kernel lock
+struct Spinlock kernel_lock = {
+	.name = "kernel_lock"
+};
+
+void
+__spin_initlock(struct Spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+	lk->cpu = 0;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct Spinlock *lk)
+{
+	if (lk->locked && lk->cpu == thiscpu)
+		panic("CPU %d cannot acquire %s: already holding",
+		      cpunum(), lk->name);
+
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	while (xchg(&lk->locked, 1) != 0) {
+		// The holder may be waiting for us to flush our TLB;
+		// see tlb_shootdown().
+		if (thiscpu->cpu_tlb_flush) {
+			lcr3(rcr3());
+			thiscpu->cpu_tlb_flush = 0;
+		}
+		asm volatile ("pause");
+	}
+
+	lk->cpu = thiscpu;
+}
+
+// Release the lock.
+void
+spin_unlock(struct Spinlock *lk)
+{
+	if (!lk->locked || lk->cpu != thiscpu)
+		panic("CPU %d cannot release %s: not holding",
+		      cpunum(), lk->name);
+
+	lk->cpu = 0;
+
+	// The xchg serializes, so that reads before release are
+	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
+	// 7.2) says reads can be carried out speculatively and in
+	// any order, which implies we need to serialize here.
+	// But the 2007 Intel 64 Architecture Memory Ordering White
+	// Paper says that Intel 64 and IA-32 will not move a load
+	// after a store. So lock->locked = 0 would work here.
+	// The xchg being asm volatile ensures gcc emits it after
+	// the above assignments (and after the critical section).
+	xchg(&lk->locked, 0);
+}
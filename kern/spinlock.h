@@ -0,0 +1,47 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Mutual exclusion lock.
+struct Spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+	const char *name;		// Name of lock
+	struct Cpu *cpu;		// The CPU holding the lock
+};
+
+void __spin_initlock(struct Spinlock *lk, const char *name);
+void spin_lock(struct Spinlock *lk);
+void spin_unlock(struct Spinlock *lk);
+
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+
+// The big kernel lock: held by whichever CPU is running in the kernel
+// (except while it is halted waiting for an interrupt), so that only
+// one CPU at a time runs kernel code.
+extern struct Spinlock kernel_lock;
+
+static inline void
+lock_kernel(void)
+{
+	spin_lock(&kernel_lock);
+}
+
+static inline void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+
+	// Normally we wouldn't need to do this, but QEMU only runs
+	// one CPU at a time and has a long time-slice.  Without the
+	// pause, this CPU is likely to reacquire the lock before
+	// another CPU has even been given a chance to acquire it.
+	asm volatile("pause");
+}
+
+#endif	// !JOS_KERN_SPINLOCK_H
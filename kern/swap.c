@@ -0,0 +1,523 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/trap.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/swap.h>
+
+struct Env *swap_pager;		// the registered pager, if any
+
+static struct Swap_slot swap_slots[SWAP_MAXSLOT];
+static uint32_t swap_nslots;	// slots the pager offered
+static uint32_t swap_nused;	// slots not SS_FREE
+static uint32_t swap_nflight;	// slots SS_OUT or SS_WRITING
+static uint32_t swap_next;	// slot to try first in slot_alloc()
+static bool swap_kicked;	// work queued while the pager wasn't waiting
+
+// The clock hand: the next page to look at
+static uint32_t clock_env;
+static uintptr_t clock_va;
+
+// Statistics for the monitor
+static uint32_t swap_nouts;	// pages written out
+static uint32_t swap_nins;	// pages read back in
+static uint32_t swap_nhits;	// faults on pages still in memory
+static uint32_t swap_nretries;	// requests retried after reclaiming
+
+static int
+slot_alloc(void)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < swap_nslots; i++) {
+		slot = (swap_next + i) % swap_nslots;
+		if (swap_slots[slot].ss_state == SS_FREE) {
+			swap_next = slot + 1;
+			swap_nused++;
+			return slot;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+//
+// Make every environment waiting for 'slot' runnable again.  They
+// retry whatever they were doing, and find the page or wait again.
+//
+static void
+swap_wake(uint32_t slot)
+{
+	struct Env *e;
+
+	for (e = envs; e < envs + NENV; e++)
+		if (e->env_swap_slot == (int32_t) slot) {
+			e->env_swap_slot = -1;
+			if (e->env_status == ENV_NOT_RUNNABLE)
+				env_set_status(e, ENV_RUNNABLE);
+		}
+}
+
+//
+// Free 'slot', which nothing refers to any more, and its page.
+//
+static void
+slot_release(uint32_t slot)
+{
+	struct Swap_slot *s = &swap_slots[slot];
+
+	assert(s->ss_ref == 0);
+	if (s->ss_state == SS_OUT || s->ss_state == SS_WRITING)
+		swap_nflight--;
+	if (s->ss_page)
+		page_decref(s->ss_page);
+	s->ss_page = NULL;
+	s->ss_state = SS_FREE;
+	swap_nused--;
+	swap_wake(slot);
+}
+
+//
+// Let the pager know there is work for it: complete its sys_ipc_recv
+// with a message from envid 0, or have its next one return at once.
+//
+static void
+swap_kick(void)
+{
+	if (swap_pager->env_ipc_recving) {
+		swap_pager->env_ipc_recving = 0;
+		swap_pager->env_ipc_from = 0;
+		swap_pager->env_ipc_value = 0;
+		swap_pager->env_ipc_perm = 0;
+		env_set_status(swap_pager, ENV_RUNNABLE);
+	} else
+		swap_kicked = 1;
+}
+
+//
+// A swap entry naming 'slot' has been copied (by pgdir_fork).
+//
+void
+swap_dup(uint32_t slot)
+{
+	assert(slot < swap_nslots && swap_slots[slot].ss_state != SS_FREE);
+	swap_slots[slot].ss_ref++;
+}
+
+//
+// A swap entry naming 'slot' has been dropped or overwritten.
+//
+void
+swap_free(uint32_t slot)
+{
+	struct Swap_slot *s;
+
+	assert(slot < swap_nslots);
+	s = &swap_slots[slot];
+	assert(s->ss_ref > 0);
+	if (--s->ss_ref > 0)
+		return;
+	// A page the pager is copying is let go of in swap_done().
+	if (s->ss_state != SS_WRITING && s->ss_state != SS_READING)
+		slot_release(slot);
+}
+
+//
+// May the current environment allocate a page for user memory?  Once
+// there is a pager, the last SWAP_RESERVE free pages are kept for it,
+// so that it can always go on swapping.
+//
+bool
+swap_may_alloc(void)
+{
+	return swap_pager == NULL || curenv == swap_pager
+		|| page_free_count() > SWAP_RESERVE;
+}
+
+static bool
+swap_env_ok(struct Env *e)
+{
+	// The idle environment must always be able to run, and the
+	// pager can't wait for itself.  Another CPU may be running 'e'
+	// with its pages in its TLB, which we can't flush from here.
+	return e->env_status != ENV_FREE && e != &envs[0] && e != swap_pager
+		&& (e->env_cpunum < 0 || e->env_cpunum == cpunum());
+}
+
+static bool
+swap_candidate(pte_t pte, uintptr_t va)
+{
+	if ((pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U) || (pte & PTE_SHARE))
+		return 0;
+	// The kernel writes to the exception stack itself.
+	if (va == UXSTACKTOP - PGSIZE)
+		return 0;
+	// Shared pages (copy-on-write, the zero page) don't free anything.
+	return pa2page(PTE_ADDR(pte))->pp_ref == 1;
+}
+
+//
+// Take away the page '*pte' maps at 'va' in 'e', to be written to a new
+// swap slot, which inherits the PTE's reference to the page.
+//
+static int
+swap_evict(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct Swap_slot *s;
+	int slot;
+
+	if ((slot = slot_alloc()) < 0)
+		return slot;
+	s = &swap_slots[slot];
+	s->ss_ref = 1;
+	s->ss_state = SS_OUT;
+	s->ss_page = pa2page(PTE_ADDR(*pte));
+	swap_nflight++;
+
+	*pte = (slot << PGSHIFT) | (*pte & PTE_USER & ~PTE_P) | PTE_SWAP;
+	tlb_invalidate(e->env_pgdir, (void *) va);
+	e->env_swapouts++;
+	return 0;
+}
+
+//
+// Move the clock hand over at most SWAP_SCANMAX page table entries.
+// Pages accessed since the hand last passed get their PTE_A cleared and
+// another round; up to 'n' of the others are evicted.  Returns the
+// number of pages evicted.
+//
+static int
+swap_reclaim(int n)
+{
+	struct Tlb_batch tb;
+	struct Env *e;
+	pde_t pde;
+	pte_t *pte;
+	int nscan, nout = 0;
+
+	tlb_batch_begin(&tb);
+	for (nscan = 0; nout < n && nscan < SWAP_SCANMAX; nscan++) {
+		e = &envs[clock_env];
+		if (clock_va >= UTOP || !swap_env_ok(e)) {
+			clock_env = (clock_env + 1) % NENV;
+			clock_va = 0;
+			continue;
+		}
+		pde = e->env_pgdir[PDX(clock_va)];
+		if (!(pde & PTE_P)) {
+			clock_va = ROUNDUP(clock_va + 1, PTSIZE);
+			continue;
+		}
+
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(clock_va);
+		if (swap_candidate(*pte, clock_va)) {
+			if (*pte & PTE_A) {
+				*pte &= ~PTE_A;
+				tlb_invalidate(e->env_pgdir, (void *) clock_va);
+			} else if (swap_evict(e, clock_va, pte) == 0)
+				nout++;
+			else
+				break;		// out of swap slots
+		}
+		clock_va += PGSIZE;
+	}
+	tlb_batch_flush(&tb);
+
+	if (nout)
+		swap_kick();
+	return nout;
+}
+
+//
+// Give up the pages of slots read back in from disk.  The slots stay
+// valid: their pages can be read again.  Returns the number of pages
+// freed.
+//
+static int
+swap_drop_cached(void)
+{
+	struct Swap_slot *s;
+	int n = 0;
+
+	for (s = swap_slots; s < swap_slots + swap_nslots; s++)
+		if (s->ss_state == SS_CACHED) {
+			if (s->ss_page->pp_ref == 1)
+				n++;
+			page_decref(s->ss_page);
+			s->ss_page = NULL;
+			s->ss_state = SS_DISK;
+		}
+	return n;
+}
+
+//
+// Handle a fault, or a system call, of curenv on 'va' in 'e'.  If the
+// page is still in memory it is simply mapped again.
+//
+// RETURNS:
+//   0 if the page is mapped at 'va' again
+//   1 if curenv has to wait for the pager to read the page in; it has
+//     been made not runnable
+//   -E_INVAL if 'va' is not swapped out
+//
+int
+swap_fault(struct Env *e, uintptr_t va)
+{
+	struct Swap_slot *s;
+	uint32_t slot;
+	pte_t *pte;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+	if (pte == NULL || !pte_is_swap(*pte))
+		return -E_INVAL;
+	slot = PTE_SWAPSLOT(*pte);
+	s = &swap_slots[slot];
+
+	switch (s->ss_state) {
+	case SS_OUT:
+	case SS_WRITING:
+	case SS_CACHED:
+		if (s->ss_state != SS_CACHED)
+			swap_nhits++;
+		// The page table exists, so this cannot fail.  The swap
+		// entry goes away, and with it, maybe, the slot.
+		r = page_insert(e->env_pgdir, s->ss_page, (void *) va,
+				(*pte & PTE_USER & ~PTE_SWAP) | PTE_P);
+		assert(r == 0);
+		e->env_swapins++;
+		return 0;
+
+	case SS_DISK:
+		s->ss_state = SS_IN;
+		swap_kick();
+		/* fall through */
+	case SS_IN:
+	case SS_READING:
+		curenv->env_swap_slot = slot;
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+		return 1;
+
+	default:
+		panic("swap_fault: swap entry %08x for free slot", *pte);
+	}
+}
+
+//
+// Called by system calls that are about to use the memory at 'va' in
+// 'e' on behalf of curenv.  Returns if 'va' is not swapped out, or was
+// still in memory.  Otherwise curenv sleeps until the pager has read
+// the page in, and then starts the system call over: this doesn't
+// return.
+//
+void
+swap_wait(struct Env *e, const void *va)
+{
+	if ((uintptr_t) va >= UTOP || swap_fault(e, (uintptr_t) va) <= 0)
+		return;
+	if (curenv->env_tf.tf_trapno == T_SYSCALL)
+		curenv->env_tf.tf_eip -= 2;	// size of "int $0x30"
+	sched_yield();
+}
+
+//
+// A system call or fault of curenv failed for lack of memory.  Reclaim
+// some pages, and if that freed any or will once the pager has written
+// them out, have curenv try again later: this doesn't return then.
+// Otherwise the caller goes on to fail as before.
+//
+void
+swap_retry(void)
+{
+	if (swap_pager == NULL || curenv == swap_pager)
+		return;
+	if (swap_drop_cached() + swap_reclaim(SWAP_BATCH) == 0
+	    && swap_nflight == 0)
+		return;
+
+	swap_nretries++;
+	if (curenv->env_tf.tf_trapno == T_SYSCALL)
+		curenv->env_tf.tf_eip -= 2;
+	sched_yield();
+}
+
+//
+// Called by the scheduler when there is nothing else to run: start
+// swapping ahead of time if free memory is low.
+//
+void
+swap_idle(void)
+{
+	if (swap_pager && page_free_count() < SWAP_LOWAT)
+		swap_reclaim(SWAP_BATCH);
+}
+
+//
+// The environment 'e' is being freed.
+//
+void
+swap_env_free(struct Env *e)
+{
+	e->env_swap_slot = -1;
+	if (e != swap_pager)
+		return;
+	if (swap_nused > 0)
+		panic("swap pager %08x exited with %d slots in use",
+		      e->env_id, swap_nused);
+	swap_pager = NULL;
+	swap_nslots = 0;
+}
+
+//
+// Make 'e' the pager, with a swap file of 'nslots' pages (at most
+// SWAP_MAXSLOT are used).  Returns the number of slots used, or
+// -E_INVAL if there already is a pager or 'nslots' is 0.
+//
+int
+swap_register(struct Env *e, uint32_t nslots)
+{
+	if (swap_pager || nslots == 0)
+		return -E_INVAL;
+	if (nslots > SWAP_MAXSLOT)
+		nslots = SWAP_MAXSLOT;
+
+	memset(swap_slots, 0, sizeof(swap_slots));
+	swap_nslots = nslots;
+	swap_nused = swap_nflight = swap_next = 0;
+	swap_kicked = 0;
+	swap_pager = e;
+	return nslots;
+}
+
+//
+// Hand the pager 'e' the next page to write out, mapped read-only at
+// 'va'.  Returns its slot, -E_NOT_FOUND if there is none, or
+// -E_NO_MEM if no page table could be allocated for 'va'.
+//
+int
+swap_out(struct Env *e, void *va)
+{
+	struct Swap_slot *s;
+	int r;
+
+	for (s = swap_slots; s < swap_slots + swap_nslots; s++)
+		if (s->ss_state == SS_OUT) {
+			r = page_insert(e->env_pgdir, s->ss_page, va,
+					PTE_U | PTE_P);
+			if (r < 0)
+				return r;
+			s->ss_state = SS_WRITING;
+			return s - swap_slots;
+		}
+	return -E_NOT_FOUND;
+}
+
+//
+// Find the next slot to read back in, and map a fresh page at 'va' for
+// the pager 'e' to read it into.  Returns the slot, -E_NOT_FOUND if
+// there is none, or -E_NO_MEM.
+//
+int
+swap_in(struct Env *e, void *va)
+{
+	struct Swap_slot *s;
+	struct Page *pp;
+	int r;
+
+	for (s = swap_slots; s < swap_slots + swap_nslots; s++)
+		if (s->ss_state == SS_IN) {
+			if ((r = page_alloc_high(&pp)) < 0)
+				return r;
+			r = page_insert(e->env_pgdir, pp, va,
+					PTE_U | PTE_W | PTE_P);
+			if (r < 0) {
+				page_free(pp);
+				return r;
+			}
+			pp->pp_ref++;	// the slot's reference
+			s->ss_page = pp;
+			s->ss_state = SS_READING;
+			return s - swap_slots;
+		}
+	return -E_NOT_FOUND;
+}
+
+//
+// The pager is done copying the page of 'slot'.  It should have
+// unmapped it already.
+//
+int
+swap_done(uint32_t slot)
+{
+	struct Swap_slot *s;
+
+	if (slot >= swap_nslots)
+		return -E_INVAL;
+	s = &swap_slots[slot];
+
+	switch (s->ss_state) {
+	case SS_WRITING:
+		swap_nflight--;
+		swap_nouts++;
+		page_decref(s->ss_page);
+		s->ss_page = NULL;
+		s->ss_state = SS_DISK;
+		break;
+	case SS_READING:
+		swap_nins++;
+		s->ss_state = SS_CACHED;
+		swap_wake(slot);
+		break;
+	default:
+		return -E_INVAL;
+	}
+
+	if (s->ss_ref == 0)
+		slot_release(slot);
+	return 0;
+}
+
+//
+// Called by sys_ipc_recv: should the receive by 'e' return at once,
+// because the kernel has work for it?
+//
+bool
+swap_pager_pending(struct Env *e)
+{
+	if (e != swap_pager || !swap_kicked)
+		return 0;
+	swap_kicked = 0;
+	return 1;
+}
+
+void
+swap_print_stats(void)
+{
+	static const char *names[] = {
+		"free", "disk", "cached", "out", "writing", "in", "reading"
+	};
+	uint32_t count[SS_READING + 1];
+	struct Swap_slot *s;
+	int i;
+
+	if (swap_pager == NULL) {
+		cprintf("no swap\n");
+		return;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (s = swap_slots; s < swap_slots + swap_nslots; s++)
+		count[s->ss_state]++;
+	cprintf("swap: %d/%d slots used, pager %08x, %d free pages\n",
+		swap_nused, swap_nslots, swap_pager->env_id, page_free_count());
+	for (i = 0; i <= SS_READING; i++)
+		cprintf("  %-8s %d\n", names[i], count[i]);
+	cprintf("%d pages out, %d in, %d faults without I/O, %d retries\n",
+		swap_nouts, swap_nins, swap_nhits, swap_nretries);
+}
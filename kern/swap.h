@@ -0,0 +1,80 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+struct Env;
+
+// Page reclaim and swapping.
+//
+// When user memory runs short, a clock hand sweeps over the address
+// spaces of all environments.  Pages accessed since the hand last passed
+// (PTE_A set) get another chance; the others are taken away and their
+// PTEs turned into swap entries (see PTE_SWAP in inc/mmu.h) naming a
+// swap slot.  The kernel does no disk I/O itself: a user-level pager,
+// the file server, registers with sys_swap_register() and copies the
+// pages in and out of a swap file, as the kernel asks it to.
+//
+// A slot keeps its page in memory until the pager has written it out,
+// and again after the pager has read it back, so a fault on a page in
+// flight is resolved at once.  Only a fault on a page that is on disk
+// waits for the pager.
+
+#define SWAP_MAXSLOT	1024	// most swap slots the pager may offer
+#define SWAP_RESERVE	16	// free pages kept for the pager
+#define SWAP_LOWAT	64	// reclaim while idle below this many free pages
+#define SWAP_BATCH	16	// pages reclaimed at a time
+#define SWAP_SCANMAX	8192	// most PTEs the clock hand passes per call
+
+// Swap slot states
+enum {
+	SS_FREE = 0,
+	SS_DISK,		// on disk only
+	SS_CACHED,		// on disk, and read back into ss_page
+	SS_OUT,			// in ss_page, waiting to be written out
+	SS_WRITING,		// ss_page mapped into the pager to be written
+	SS_IN,			// on disk, waiting to be read in
+	SS_READING,		// ss_page mapped into the pager to be read into
+};
+
+struct Swap_slot {
+	uint16_t ss_ref;	// swap entries naming this slot
+	uint16_t ss_state;	// SS_*
+	struct Page *ss_page;	// page holding the data, if any
+};
+
+extern struct Env *swap_pager;
+
+static inline bool
+pte_is_swap(pte_t pte)
+{
+	return (pte & (PTE_P | PTE_SWAP)) == PTE_SWAP;
+}
+
+// Used by pmap.c as swap entries are copied and dropped
+void	swap_dup(uint32_t slot);
+void	swap_free(uint32_t slot);
+
+bool	swap_may_alloc(void);
+int	swap_fault(struct Env *e, uintptr_t va);
+void	swap_wait(struct Env *e, const void *va);
+void	swap_retry(void);
+void	swap_idle(void);
+void	swap_env_free(struct Env *e);
+
+// The pager's side, behind the system calls of the same names
+int	swap_register(struct Env *e, uint32_t nslots);
+int	swap_out(struct Env *e, void *va);
+int	swap_in(struct Env *e, void *va);
+int	swap_done(uint32_t slot);
+bool	swap_pager_pending(struct Env *e);
+
+void	swap_print_stats(void);
+
+#endif	// !JOS_KERN_SWAP_H
@@ -11,6 +11,9 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/shm.h>
+#include <kern/kclock.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -43,6 +46,17 @@ sys_getenvid(void)
 	return curenv->env_id;
 }
 
+// Store the nanoseconds since boot in *ns.
+// Returns 0; destroys the environment if ns isn't writable.
+// (User programs can read the same clock without a trap; see lib/time.c.)
+static int
+sys_time(uint64_t *ns)
+{
+	user_mem_assert(curenv, ns, sizeof(*ns), PTE_U | PTE_W);
+	*ns = clock_ns();
+	return 0;
+}
+
 // Destroy a given environment (possibly the currently running environment).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
@@ -54,8 +68,8 @@ sys_env_destroy(envid_t envid)
 	struct Env *e;
 	int errno;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
-		return r;
+	if ((errno = envid2env(envid, &e, 1)) < 0)
+		return errno;
 
 //	errno = envid2env(envid, &e, 1);
 //	if (errno < 0)
@@ -98,7 +112,7 @@ sys_exofork(void)
 		return errno;
 	
 	// ...status is set to ENV_NOT_RUNNABLE
-	child->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(child, ENV_NOT_RUNNABLE);
 
 	// ...the register set is copied from the current environment
 	child->env_tf = curenv->env_tf;
@@ -109,6 +123,46 @@ sys_exofork(void)
 	return child->env_id;
 }
 
+// Fork the current environment, entirely in the kernel.
+// The child gets a copy-on-write copy of the parent's address space
+// (see pgdir_fork), a fresh user exception stack, the parent's page
+// fault upcall and register set, and is marked runnable right away.
+// In the child, sys_fork appears to return 0.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *child;
+	struct Page *pp;
+	int errno;
+
+	errno = env_alloc(&child, curenv->env_id);
+	if (errno < 0)
+		return errno;
+
+	if ((errno = pgdir_fork(child->env_pgdir, curenv->env_pgdir)) < 0
+	    || (errno = page_alloc_high_zero(&pp)) < 0)
+		goto fail;
+	if ((errno = page_insert(child->env_pgdir, pp, 
+			(void *) (UXSTACKTOP - PGSIZE), PTE_U|PTE_W|PTE_P)) < 0) {
+		page_free(pp);
+		goto fail;
+	}
+
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	child->env_tf = curenv->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	env_set_status(child, ENV_RUNNABLE);
+	return child->env_id;
+
+fail:
+	env_free(child);
+	return errno;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -140,11 +194,82 @@ sys_env_set_status(envid_t envid, int status)
 	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
 		return -E_INVAL;
 
-	env->env_status = status;
+	env_set_status(env, status);
 	
 	return 0;
 }
 
+// Set envid's scheduling priority to 'priority', from ENV_PRIO_LOW up
+// to the caller's own priority.  The environment only runs while no
+// environment of a higher priority is runnable, so letting an
+// environment raise itself would let it starve the file server.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is out of range or above the caller's.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *env;
+	int errno;
+
+	if ((errno = envid2env(envid, &env, 1)) < 0)
+		return errno;
+	if (priority < ENV_PRIO_LOW || priority > ENV_PRIO_MAX
+	    || (uint32_t) priority > curenv->env_priority)
+		return -E_INVAL;
+
+	env_set_priority(env, priority);
+	return 0;
+}
+
+// Set envid's share of the CPU under stride scheduling to 'tickets',
+// from 1 to ENV_MAXTICKETS.  Children created afterwards get the same
+// number of tickets.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if tickets is out of range.
+static int
+sys_env_set_tickets(envid_t envid, int tickets)
+{
+	struct Env *env;
+	int errno;
+
+	if ((errno = envid2env(envid, &env, 1)) < 0)
+		return errno;
+	if (tickets < 1 || tickets > ENV_MAXTICKETS)
+		return -E_INVAL;
+
+	env->env_tickets = tickets;
+	return 0;
+}
+
+// Let envid run only on the CPUs in 'mask', bit i for CPU i.  Bits for
+// CPUs that don't exist are ignored.  Children created afterwards get
+// the same mask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask has no CPU that exists.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	struct Env *env;
+	int errno;
+
+	if ((errno = envid2env(envid, &env, 1)) < 0)
+		return errno;
+	if (!(mask & ((1 << ncpu) - 1)))
+		return -E_INVAL;
+
+	sched_set_affinity(env, mask);
+	return 0;
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -188,6 +313,110 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	return 0;
 }
 
+// Is 'perm' acceptable for a user mapping?  PTE_U | PTE_P must be set,
+// and nothing outside PTE_USER.
+static bool
+perm_ok(int perm)
+{
+	return (perm & (PTE_U | PTE_P)) == (PTE_U | PTE_P)
+		&& (perm & ~PTE_USER) == 0;
+}
+
+// The workers behind sys_page_alloc, sys_page_map and sys_page_unmap
+// (and sys_page_batch), for environments that have already been looked
+// up and checked with envid2env.  Errors are as for the system calls.
+static int
+env_page_alloc(struct Env *env, void *va, int perm)
+{
+	struct Page *pp;
+	int errno;
+
+	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
+		return -E_INVAL;
+	if (!perm_ok(perm))
+		return -E_INVAL;
+
+	if ((errno = page_alloc_high_zero(&pp)) < 0)
+		return errno;
+	if ((errno = page_insert(env->env_pgdir, pp, va, perm)) < 0) {
+		page_free(pp);
+		return errno;
+	}
+	return 0;
+}
+
+// Map the kernel's shared zero page at 'va' instead of a page of its
+// own: 'va' gets a page on the first write if 'perm' has PTE_W (see
+// page_map_zero).  'perm' may not have PTE_COW, which the kernel sets
+// itself.
+static int
+env_page_alloc_zero(struct Env *env, void *va, int perm)
+{
+	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
+		return -E_INVAL;
+	if (!perm_ok(perm) || (perm & PTE_COW))
+		return -E_INVAL;
+	return page_map_zero(env->env_pgdir, va, perm);
+}
+
+static int
+env_page_map(struct Env *srcenv, void *srcva,
+	     struct Env *dstenv, void *dstva, int perm)
+{
+	struct Page *pp;
+	pte_t *pte;
+
+	if ((uint32_t)srcva >= UTOP || (uint32_t)srcva % PGSIZE != 0 ||
+			(uint32_t)dstva >= UTOP || (uint32_t)dstva % PGSIZE != 0)
+		return -E_INVAL;
+	if (!perm_ok(perm))
+		return -E_INVAL;
+
+	pp = page_lookup(srcenv->env_pgdir, srcva, &pte);
+	if (pp == NULL || !(*pte & PTE_P))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+
+	// The page is still mapped in srcenv, so it must not be freed
+	// if this fails.
+	return page_insert(dstenv->env_pgdir, pp, dstva, perm);
+}
+
+static int
+env_page_unmap(struct Env *env, void *va)
+{
+	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
+		return -E_INVAL;
+
+	page_remove(env->env_pgdir, va);
+	return 0;
+}
+
+// Change the permissions of the page mapped at 'va' to 'perm'.
+// Like for sys_page_map, write access can't be granted to a read-only
+// page.  Errors are -E_INVAL for a bad 'va' or 'perm', or if nothing is
+// mapped at 'va'.
+static int
+env_page_protect(struct Env *env, void *va, int perm)
+{
+	pte_t *pte;
+
+	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
+		return -E_INVAL;
+	if (!perm_ok(perm))
+		return -E_INVAL;
+
+	if (page_lookup(env->env_pgdir, va, &pte) == NULL || !(*pte & PTE_P))
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+
+	*pte = PTE_ADDR(*pte) | perm;
+	tlb_invalidate(env->env_pgdir, va);
+	return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -207,51 +436,14 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 static int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
-	// Hint: This function is a wrapper around page_alloc() and
-	//   page_insert() from kern/pmap.c.
-	//   Most of the new code you write should be to check the
-	//   parameters for correctness.
-	//   If page_insert() fails, remember to free the page you
-	//   allocated!
-
 	// LAB 4:
 	struct Env* env;
 	int errno;				
 	errno = envid2env(envid, &env, 1);	
-	if (errno < 0) {
-		if (errno == -E_BAD_ENV)
-			return errno;			
-		else
-			panic("unexpected error %d", errno);	
-	}
-
-	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
-		return -E_INVAL;
-
-	// TODO: More permission checks needed?
-	if ((perm | PTE_U | PTE_P) != perm)
-		return -E_INVAL;
-
-	struct Page* pp;
-	errno = page_alloc(&pp);
-	if (errno < 0) {
-		if (errno == -E_NO_MEM)
-			return errno;
-		else
-			panic("unexpected error %d", errno);	
-	}
+	if (errno < 0)
+		return errno;
 
-	errno = page_insert(env->env_pgdir, pp, va, perm);
-	if (errno < 0) {
-		if (errno == -E_NO_MEM) {
-			page_free(pp);
-			return errno;	
-		}	
-		else
-			panic("unexpected error %d", errno);	
-	}
-	
-	return 0;
+	return env_page_alloc(env, va, perm);
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -274,60 +466,18 @@ static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
 {
-	// Hint: This function is a wrapper around page_lookup() and
-	//   page_insert() from kern/pmap.c.
-	//   Again, most of the new code you write should be to check the
-	//   parameters for correctness.
-	//   Use the third argument to page_lookup() to
-	//   check the current permissions on the page.
-
 	// LAB 4:
 	struct Env* srcenv;
 	struct Env* dstenv;
 	int errno;
 
-	if ((uint32_t)srcva >= UTOP || (uint32_t)srcva % PGSIZE != 0 ||
-			(uint32_t)dstva >= UTOP || (uint32_t)dstva % PGSIZE != 0)
-		return -E_INVAL;
-
-	errno = envid2env(srcenvid, &srcenv, 1);	
-	if (errno < 0) {
-		if (errno == -E_BAD_ENV)
-			return errno;			
-		else
-			panic("unexpected error %d", errno);	
-	}
-
-	errno = envid2env(dstenvid, &dstenv, 1);	
-	if (errno < 0) {
-		if (errno == -E_BAD_ENV)
-			return errno;			
-		else
-			panic("unexpected error %d", errno);	
-	}
-	
-	struct Page* pp;
-	pte_t * pte_ptr;
-	pp = page_lookup(srcenv->env_pgdir, srcva, &pte_ptr);
-	
-	// TODO: Review permissions
-	if (!((PTE_U & perm) && (PTE_P & perm) && !((!PTE_USER) & perm)))
-		return -E_INVAL;
-
-	if ((perm & PTE_W) && (!(*pte_ptr & PTE_W)))
-		return -E_INVAL;
-
-	errno = page_insert(dstenv->env_pgdir, pp, dstva, perm);
-	if (errno < 0) {
-		if (errno == -E_NO_MEM) {
-			page_free(pp);
-			return errno;	
-		}	
-		else
-			panic("unexpected error %d", errno);	
-	}
+	if ((errno = envid2env(srcenvid, &srcenv, 1)) < 0)
+		return errno;
+	if ((errno = envid2env(dstenvid, &dstenv, 1)) < 0)
+		return errno;
 
-	return 0;
+	swap_wait(srcenv, srcva);
+	return env_page_map(srcenv, srcva, dstenv, dstva, perm);
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -340,25 +490,121 @@ sys_page_map(envid_t srcenvid, void *srcva,
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
-	// Hint: This function is a wrapper around page_remove().
-
 	// LAB 4:
 	struct Env* env;
 	int errno;				
 	errno = envid2env(envid, &env, 1);	
-	if (errno < 0) {
-		if (errno == -E_BAD_ENV)
-			return errno;			
-		else
-			panic("unexpected error %d", errno);	
+	if (errno < 0)
+		return errno;
+
+	return env_page_unmap(env, va);
+}
+
+// Look up 'envid' for sys_page_batch, reusing the answer remembered in
+// '*cache'/'*cacheid' when it is for the same envid, so that a batch
+// checks each environment only once.
+static int
+batch_envid2env(envid_t envid, struct Env **cache, envid_t *cacheid,
+		struct Env **env_store)
+{
+	int errno;
+
+	if (*cache == NULL || *cacheid != envid) {
+		if ((errno = envid2env(envid, cache, 1)) < 0) {
+			*cache = NULL;
+			return errno;
+		}
+		*cacheid = envid;
 	}
+	*env_store = *cache;
+	return 0;
+}
 
-	if ((uintptr_t)va >= UTOP || (uint32_t)va % PGSIZE != 0)
+// The operations of the sys_page_batch call in progress, copied out of
+// user memory.  Protected by the big kernel lock.
+static struct Page_op batch_ops[PGOP_MAX];
+
+// Apply 'n' page operations from the array 'ops' (see struct Page_op
+// in inc/syscall.h) in one system call.  Every operation is attempted,
+// also after one has failed, and its 'result' field is set to 0 or to
+// the error the corresponding single-page system call would return.
+// The TLB is flushed once, at the end.
+//
+// The operations are applied from a copy in the kernel, and the results
+// are stored back only after the TLB flush: the batch may unmap or
+// write-protect the page holding 'ops' itself.
+//
+// Returns the number of operations that failed, or < 0 on error:
+//	-E_INVAL if n < 0 or n > PGOP_MAX.
+// Destroys the environment if 'ops' is not writable user memory, before
+// or after the operations are applied.
+static int
+sys_page_batch(struct Page_op *ops, int n)
+{
+	struct Env *srcenv, *dstenv, *srccache = NULL, *dstcache = NULL;
+	envid_t srcid = 0, dstid = 0;
+	struct Page_op *op;
+	struct Tlb_batch tb;
+	int i, nfail = 0;
+
+	if (n < 0 || n > PGOP_MAX)
 		return -E_INVAL;
+	user_mem_assert(curenv, ops, n * sizeof(struct Page_op), PTE_U | PTE_W);
+	memmove(batch_ops, ops, n * sizeof(struct Page_op));
+
+	// Bring back the swapped-out pages the operations look at before
+	// changing anything, since waiting for one starts the call over.
+	for (op = batch_ops; op < batch_ops + n; op++) {
+		if (op->op == PGOP_MAP && envid2env(op->srcenv, &srcenv, 1) == 0)
+			swap_wait(srcenv, op->srcva);
+		else if (op->op == PGOP_PROTECT
+			 && envid2env(op->dstenv, &dstenv, 1) == 0)
+			swap_wait(dstenv, op->dstva);
+	}
 
-	page_remove(env->env_pgdir, va);
+	tlb_batch_begin(&tb);
+	for (op = batch_ops; op < batch_ops + n; op++) {
+		if ((op->result = batch_envid2env(op->dstenv, &dstcache,
+				&dstid, &dstenv)) < 0) {
+			nfail++;
+			continue;
+		}
+
+		switch (op->op) {
+		case PGOP_ALLOC:
+			op->result = env_page_alloc(dstenv, op->dstva, op->perm);
+			break;
+		case PGOP_ALLOC_ZERO:
+			op->result = env_page_alloc_zero(dstenv, op->dstva,
+					op->perm);
+			break;
+		case PGOP_MAP:
+			op->result = batch_envid2env(op->srcenv, &srccache,
+					&srcid, &srcenv);
+			if (op->result == 0)
+				op->result = env_page_map(srcenv, op->srcva,
+						dstenv, op->dstva, op->perm);
+			break;
+		case PGOP_UNMAP:
+			op->result = env_page_unmap(dstenv, op->dstva);
+			break;
+		case PGOP_PROTECT:
+			op->result = env_page_protect(dstenv, op->dstva, op->perm);
+			break;
+		default:
+			op->result = -E_INVAL;
+			break;
+		}
+		if (op->result < 0)
+			nfail++;
+	}
+	tlb_batch_flush(&tb);
 
-	return 0;
+	// The batch may have changed the mapping of 'ops'; look again.
+	user_mem_assert(curenv, ops, n * sizeof(struct Page_op), PTE_U | PTE_W);
+	for (i = 0; i < n; i++)
+		ops[i].result = batch_ops[i].result;
+	return nfail;
 }
 
 // Try to send 'value' to the target env 'envid'.
@@ -417,6 +663,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 
 	if (dstenv->env_ipc_recving == 0)
 		return -E_IPC_NOT_RECV;
+	swap_wait(curenv, srcva);
 
 	dstenv->env_ipc_recving = 0;
 	dstenv->env_ipc_from = curenv->env_id;
@@ -434,7 +681,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		dstenv->env_ipc_perm = 0;
 	}
 
-	dstenv->env_status = ENV_RUNNABLE;
+	env_set_status(dstenv, ENV_RUNNABLE);
 
 	return 0;
 }
@@ -461,7 +708,7 @@ sys_ipc_recv(void *dstva)
 	if (errno < 0)
 		panic("sys_ipc_recv: get envid error %e", errno);
 
-	if ((uint32_t)dstva < UTOP && ((uint32_t) dstva % PGSIZE) == 0)
+	if ((uint32_t)dstva < UTOP && ((uint32_t) dstva % PGSIZE) != 0)
 		return -E_INVAL;
 
 	penv->env_ipc_recving = 1;
@@ -469,11 +716,135 @@ sys_ipc_recv(void *dstva)
 	penv->env_ipc_value = 0;
 	penv->env_ipc_perm = 0;
 	penv->env_ipc_from = 0;
-	penv->env_status = ENV_NOT_RUNNABLE;
+	sched_boost(penv);
+	env_set_status(penv, ENV_NOT_RUNNABLE);
+
+	// The swap pager gets a message from envid 0 when the kernel has
+	// pages for it; if some came in while it was busy, don't wait.
+	if (swap_pager_pending(penv)) {
+		penv->env_ipc_recving = 0;
+		env_set_status(penv, ENV_RUNNABLE);
+	}
 
 	return 0;
 }
 
+// Make the current environment the swap pager, with a swap file of
+// 'nslots' pages.  See kern/swap.h.
+//
+// Returns the number of slots the kernel will use, or < 0 on error:
+//	-E_INVAL if there already is a pager, or nslots is 0.
+static int
+sys_swap_register(uint32_t nslots)
+{
+	return swap_register(curenv, nslots);
+}
+
+// For the swap pager: map the next page to write to the swap file
+// read-only at 'va', and return its swap slot.  The pager writes the
+// page to the slot, unmaps it and calls sys_swap_done().
+//
+// Errors are:
+//	-E_BAD_ENV if the caller isn't the swap pager.
+//	-E_INVAL if va >= UTOP or va is not page-aligned.
+//	-E_NOT_FOUND if there is no page to write out.
+//	-E_NO_MEM if there's no memory for a page table.
+static int
+sys_swap_out(void *va)
+{
+	if (curenv != swap_pager)
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE != 0)
+		return -E_INVAL;
+	return swap_out(curenv, va);
+}
+
+// For the swap pager: map a fresh page writable at 'va', to read the
+// next swap slot wanted back into, and return the slot.  The pager
+// then unmaps the page and calls sys_swap_done().  Errors are like for
+// sys_swap_out, with -E_NO_MEM also if there's no page to read into.
+static int
+sys_swap_in(void *va)
+{
+	if (curenv != swap_pager)
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP || (uintptr_t) va % PGSIZE != 0)
+		return -E_INVAL;
+	return swap_in(curenv, va);
+}
+
+// For the swap pager: the page of swap slot 'slot' has been written
+// out or read in.  Environments waiting for it can go on.
+//
+// Errors are:
+//	-E_BAD_ENV if the caller isn't the swap pager.
+//	-E_INVAL if the pager isn't copying the page of 'slot'.
+static int
+sys_swap_done(uint32_t slot)
+{
+	if (curenv != swap_pager)
+		return -E_BAD_ENV;
+	return swap_done(slot);
+}
+
+// Look up the shared memory region called 'name' ('len' bytes, with no
+// NUL), or if 'flags' has SHM_CREATE, create it with 'npages' zeroed
+// pages if there is none.  See kern/shm.h.
+//
+// Returns the region's id, or < 0 on error.  Errors are:
+//	-E_NOT_FOUND if there is no such region and SHM_CREATE is not set.
+//	-E_INVAL if the name is empty or too long (see SHM_NAMELEN),
+//		or the region has fewer than 'npages' pages,
+//		or a new region would have 0 or more than SHM_MAXPAGES pages.
+//	-E_MAX_OPEN if there are too many regions.
+//	-E_NO_MEM if there's no memory for the pages.
+// Destroys the environment if 'name' is not readable user memory.
+static int
+sys_shm_open(const char *name, size_t len, uint32_t npages, int flags)
+{
+	char buf[SHM_NAMELEN];
+
+	if (len >= SHM_NAMELEN)
+		return -E_INVAL;
+	user_mem_assert(curenv, name, len, PTE_U);
+	memmove(buf, name, len);
+	buf[len] = '\0';
+	return shm_open(buf, npages, flags);
+}
+
+// Map all pages of region 'shmid' into the current environment from
+// 'va' on, with permission 'perm' (as in sys_page_alloc, but without
+// PTE_COW) plus PTE_SHARE.  Whatever was mapped there is unmapped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if 'shmid' is not a region, if 'va' is not page-aligned
+//		or the region doesn't fit below UTOP there,
+//		or if perm is inappropriate.
+//	-E_NO_MEM if there's no memory for the page tables.
+static int
+sys_shm_attach(int32_t shmid, void *va, int perm)
+{
+	if (!perm_ok(perm) || (perm & PTE_COW))
+		return -E_INVAL;
+	return shm_attach(curenv, shmid, va, perm);
+}
+
+// Unmap the pages of region 'shmid' that are mapped from 'va' on in
+// the current environment.  Errors are -E_INVAL as for sys_shm_attach.
+static int
+sys_shm_detach(int32_t shmid, void *va)
+{
+	return shm_detach(curenv, shmid, va);
+}
+
+// Remove the name of region 'shmid'; its pages go away once no
+// environment maps them.  Returns 0, or -E_INVAL if there is no such
+// region.
+static int
+sys_shm_remove(int32_t shmid)
+{
+	return shm_remove(shmid);
+}
 
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
@@ -501,11 +872,13 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return 0;
 
 	case SYS_page_alloc:
-		return (int32_t) sys_page_alloc((envid_t) a1, (void*) a2, (int) a3);
+		ret = sys_page_alloc((envid_t) a1, (void*) a2, (int) a3);
+		break;
 
 	case SYS_page_map:
-		return (int32_t) sys_page_map((envid_t) a1, (void*) a2,
+		ret = sys_page_map((envid_t) a1, (void*) a2,
 	     		(envid_t) a3, (void*) a4, (int) a5);
+		break;
 
 	case SYS_page_unmap:
 		return (int32_t) sys_page_unmap((envid_t) a1, (void*) a2);
@@ -516,6 +889,15 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_env_set_status:
 		return (int32_t) sys_env_set_status((envid_t) a1, (int) a2);
 
+	case SYS_env_set_priority:
+		return sys_env_set_priority((envid_t) a1, (int) a2);
+
+	case SYS_env_set_tickets:
+		return sys_env_set_tickets((envid_t) a1, (int) a2);
+
+	case SYS_env_set_affinity:
+		return sys_env_set_affinity((envid_t) a1, a2);
+
 	case SYS_env_set_pgfault_upcall:
 		return sys_env_set_pgfault_upcall((envid_t) a1, (void*) a2);
 
@@ -526,11 +908,52 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case (int32_t) SYS_ipc_recv:
 		return sys_ipc_recv((void *) a1);
 
+	case SYS_fork:
+		ret = sys_fork();
+		break;
+
+	case SYS_page_batch:
+		return sys_page_batch((struct Page_op *) a1, (int) a2);
+
+	case SYS_swap_register:
+		return sys_swap_register(a1);
+
+	case SYS_swap_out:
+		return sys_swap_out((void *) a1);
+
+	case SYS_swap_in:
+		return sys_swap_in((void *) a1);
+
+	case SYS_swap_done:
+		return sys_swap_done(a1);
+
+	case SYS_shm_open:
+		ret = sys_shm_open((const char *) a1, a2, a3, a4);
+		break;
+
+	case SYS_shm_attach:
+		ret = sys_shm_attach(a1, (void *) a2, a3);
+		break;
+
+	case SYS_shm_detach:
+		return sys_shm_detach(a1, (void *) a2);
+
+	case SYS_shm_remove:
+		return sys_shm_remove(a1);
+
+	case SYS_time:
+		return sys_time((uint64_t *) a1);
+
 
 	default:
 		//panic("syscall %d not implemented", syscallno);
 		return -E_INVAL;
 	}
 
+	// Out of memory: if swapping can get some back, this call is
+	// made again later instead of failing (swap_retry doesn't return).
+	if (ret == -E_NO_MEM)
+		swap_retry();
+	return ret;
 }
 
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -9,13 +10,14 @@
 #include <kern/env.h>
 #include <kern/syscall.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define XVTRAP(num) (extern void trap_inter ## num();)
 
-static struct Taskstate ts;
-
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
  */
@@ -56,6 +58,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_WAKEUP)
+		return "Wakeup IPI";
 	return "(unknown trap)";
 }
 
@@ -107,6 +111,7 @@ idt_init(void)
 	extern void irq13_handler();
 	extern void irq14_handler();
 	extern void irq15_handler();
+	extern void irq_wakeup_handler();
 
 	SETGATE(idt[T_DIVIDE], 1, GD_KT, trap_divide, 0);
 	SETGATE(idt[T_DEBUG], 1, GD_KT, trap_debug, 0);
@@ -150,19 +155,31 @@ idt_init(void)
 	SETGATE(idt[IRQ_OFFSET + 13], 0, GD_KT, irq13_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, irq14_handler, 0);
 	SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, irq15_handler, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, irq_wakeup_handler, 0);
+
+	trap_init_percpu();
+}
+
+// Load the IDT and a TSS of its own on the calling CPU.
+void
+trap_init_percpu(void)
+{
+	struct Cpu *c = thiscpu;
+	int i = cpunum();
 
 	// Setup a TSS so that we get the right stack
-	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	// when we trap to the kernel: this CPU's stack (see
+	// i386_vm_init()).
+	c->cpu_ts.ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	c->cpu_ts.ts_ss0 = GD_KD;
 
 	// Initialize the TSS field of the gdt.
-	gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) (&c->cpu_ts),
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
 
 	// Load the TSS
-	ltr(GD_TSS);
+	ltr(GD_TSS0 + (i << 3));
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
@@ -216,30 +233,48 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 	
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS)
+		irq_count[tf->tf_trapno - IRQ_OFFSET]++;
+
 	// Handle clock interrupts.
 	// LAB 4: 
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		lapic_eoi();
 		if(tf->tf_cs == GD_KT) {
+			// A halted CPU was woken up (see sched_halt()).
 			return;
 		}
 		else {
-			sched_yield();
+			sched_tick();
 			return;
 		}
 	}
 
-	// Unexpected trap: The user process or the kernel has a bug.
-	print_trapframe(tf);
-	if (tf->tf_cs == GD_KT)
-		panic("unhandled trap in kernel");
-	else {
-		env_destroy(curenv);
+	// Another CPU gave this one something to run, or wanted its TLB
+	// flushed (done while waiting in lock_kernel()); trap() takes it
+	// from here.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+		lapic_eoi();
+		return;
+	}
+
+	// Keystrokes that arrive while the CPU is halted.  (Through the
+	// 8259A, in automatic EOI mode.)
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
+		kbd_intr();
+		return;
+	}
+
+	// The file system server drives the disk by polling, and reading
+	// the disk's status clears its interrupt: just acknowledge it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_IDE) {
+		lapic_eoi();
 		return;
 	}
 
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
-	// IRQ line or other reasons. We don't care.
+	// IRQ line or other reasons. We don't care.  (They take no EOI.)
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SPURIOUS) {
 		cprintf("Spurious interrupt on irq 7\n");
 		print_trapframe(tf);
@@ -268,12 +303,28 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// A CPU halted in sched_halt() gave up the kernel lock; take it
+	// back before doing anything.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		lock_kernel();
+		sched_idle_end();
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		lock_kernel();
+		assert(curenv);
+
+		// Another CPU destroyed curenv while it ran here.
+		if (curenv->env_status == ENV_DYING) {
+			env_free(curenv);
+			curenv = NULL;
+			sched_yield();
+		}
+
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
-		assert(curenv);
 		curenv->env_tf = *tf;
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
@@ -309,6 +360,25 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Writes to copy-on-write and demand-zero pages are resolved
+	// right here, and so are swapped-out pages (the environment may
+	// have to wait for them); the environment never hears about them.
+	// Only other faults go to the page fault upcall.
+	if (!(tf->tf_err & FEC_PR) && swap_fault(curenv, fault_va) >= 0)
+		return;
+	if (tf->tf_err & FEC_WR) {
+		int r = page_cow_fault(curenv->env_pgdir, (void *) fault_va);
+		if (r == 0)
+			return;
+		if (r == -E_NO_MEM) {
+			swap_retry();
+			cprintf("[%08x] out of memory for copy-on-write page va %08x\n",
+				curenv->env_id, fault_va);
+			env_destroy(curenv);
+			return;
+		}
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -95,82 +91,28 @@ duppage(envid_t envid, unsigned pn)
 }
 
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// The kernel does all the work: sys_fork copies our address space
+// copy-on-write, gives the child its own exception stack and our
+// page fault handler setup, and marks it runnable.  Faults on the
+// copy-on-write pages are resolved by the kernel too, so there is no
+// need for a page fault handler here.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use vpd, vpt, and duppage.
-//   Remember to fix "env" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
-//
 envid_t
 fork(void)
 {
-	// LAB 4:
-	extern void _pgfault_upcall(void);
 	envid_t childid;
-	set_pgfault_handler(pgfault);
 
-	if ((childid = sys_exofork()) < 0) 
-		panic("fork: sys_exofork %e", childid);
+	if ((childid = sys_fork()) < 0)
+		panic("fork: sys_fork %e", childid);
 
-	if (childid == 0) {
-
-		// Fix env in the child process.
+	// Fix env in the child process.
+	if (childid == 0)
 		env = &envs[ENVX(sys_getenvid())];
-		return 0;
-	}
-
-	// TODO: Check for bugs here:
-	// Copy our address space to the child.
-	uint32_t pdex, ptex, pn;
-	for (pdex = PDX(UTEXT); pdex <= PDX(USTACKTOP); pdex++) {
-		if (vpd[pdex] & (PTE_P)) {
-			for (ptex = 0; ptex < NPTENTRIES; ptex++) {
-				pn = (pdex << 10) + ptex;
-				if ((pn < VPN(UXSTACKTOP - PGSIZE)) &&
-						(vpt[pn] & PTE_P)) {
-					duppage(childid, pn);
-				}
-			}
-		}
-	}
 
-	// Allocate a new page for the child's user exception stack and copy
-	// our page fault handler setup to the child.
-	int errno;
-	errno = sys_page_alloc(childid, (void *) (UXSTACKTOP-PGSIZE), 
-			PTE_P|PTE_W|PTE_U);
-	if (errno < 0)
-		return errno;
-
-	errno = sys_page_map(childid, (void *) (UXSTACKTOP-PGSIZE), 0, UTEMP,
-			PTE_P|PTE_U|PTE_W);
-	if (errno < 0)
-		return errno;
-
-	memmove(UTEMP, (void *) (UXSTACKTOP-PGSIZE), PGSIZE);
-	
-	errno = sys_page_unmap(0, UTEMP);
-	if (errno < 0) 
-		return errno;
-
-	errno = sys_env_set_pgfault_upcall(childid, _pgfault_upcall);
-	if (errno < 0)
-		return errno;
-
-	// Mark the child as runnable and return.
-	errno = sys_env_set_status(childid, ENV_RUNNABLE);
-	if (errno < 0)
-		return errno;
-	
 	return childid;
 }
 
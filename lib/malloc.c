@@ -0,0 +1,243 @@
+// The user heap: sbrk() and a size-class malloc() on top of it.
+//
+// Small requests (up to MALLOC_MAXCLASS bytes) are rounded up to a
+// power of two and served from a free list per size class.  The lists
+// are refilled a page at a time from the heap, the whole page carved
+// into objects.  heap_class[] records the class of each such page, so
+// free() finds the class of an object in O(1) and just pushes the
+// object on its list.
+//
+// Larger requests get whole pages of their own, behind a struct Chunk
+// header, so no large object is page-aligned and ROUNDDOWN(ptr, PGSIZE)
+// is its header.  When they are freed the pages are unmapped, and the
+// address range is kept for later large requests.
+
+#include <inc/lib.h>
+#include <inc/malloc.h>
+
+#define MALLOC_MINCLASS	16
+#define MALLOC_MAXCLASS	2048
+#define MALLOC_NCLASS	8		// 16, 32, ..., 2048
+#define MALLOC_NRUNS	64		// freed large ranges remembered
+#define MALLOC_BATCH	32		// pages mapped per sys_page_batch
+
+#define CHUNK_MAGIC	0x6d616c6c	// "mall"
+
+struct Chunk {
+	uint32_t ch_magic;
+	uint32_t ch_npages;		// pages in the chunk
+	uint32_t ch_pad[2];
+};
+
+// heap_class[] entry of the page at 'va'
+#define HEAP_PAGE(va)	(((uintptr_t) (va) - UHEAP) / PGSIZE)
+
+// An unmapped range of the heap, left by a freed large object
+struct Run {
+	uintptr_t r_va;
+	uint32_t r_npages;
+};
+
+static uintptr_t heap_brk = UHEAP;	// the program break
+static void *free_list[MALLOC_NCLASS];
+static struct Run runs[MALLOC_NRUNS];
+// 1 + the size class of each heap page carved into small objects, or 0.
+// In the bss, so only the pages of it that are used get frames.
+static uint8_t heap_class[(UHEAPTOP - UHEAP) / PGSIZE];
+
+//
+// Map demand-zero pages at [va, va + npages*PGSIZE) (or unmap them, if
+// 'map' is false), MALLOC_BATCH pages per system call.
+//
+static int
+heap_map(uintptr_t va, uint32_t npages, bool map)
+{
+	struct Page_op ops[MALLOC_BATCH];
+	uint32_t i, n;
+	int r;
+
+	while (npages > 0) {
+		n = MIN(npages, MALLOC_BATCH);
+		for (i = 0; i < n; i++) {
+			ops[i].op = map ? PGOP_ALLOC_ZERO : PGOP_UNMAP;
+			ops[i].dstenv = 0;
+			ops[i].dstva = (void *) (va + i * PGSIZE);
+			ops[i].perm = PTE_P|PTE_U|PTE_W;
+		}
+		if ((r = sys_page_batch(ops, n)) < 0)
+			return r;
+		if (r > 0)
+			for (i = 0; i < n; i++)
+				if (ops[i].result < 0)
+					return ops[i].result;
+		va += n * PGSIZE;
+		npages -= n;
+	}
+	return 0;
+}
+
+//
+// Move the program break by 'increment' bytes and return the old
+// break.  Pages that come into the heap read as zeros, and pages that
+// fall out of it are unmapped.  Returns NULL if the break would leave
+// [UHEAP, UHEAPTOP] or there is no memory.
+//
+void *
+sbrk(intptr_t increment)
+{
+	uintptr_t old = heap_brk, new = heap_brk + increment;
+	uintptr_t oldtop = ROUNDUP(old, PGSIZE), newtop = ROUNDUP(new, PGSIZE);
+
+	if (increment > 0 && (new < old || new > UHEAPTOP))
+		return NULL;
+	if (increment < 0 && (new > old || new < UHEAP))
+		return NULL;
+
+	if (newtop > oldtop) {
+		if (heap_map(oldtop, (newtop - oldtop) / PGSIZE, 1) < 0) {
+			heap_map(oldtop, (newtop - oldtop) / PGSIZE, 0);
+			return NULL;
+		}
+	} else if (newtop < oldtop)
+		heap_map(newtop, (oldtop - newtop) / PGSIZE, 0);
+
+	heap_brk = new;
+	return (void *) old;
+}
+
+//
+// Get 'npages' mapped, page-aligned pages for a chunk: from a freed
+// large range if one is big enough, else from the break.
+//
+static struct Chunk *
+chunk_alloc(uint32_t npages)
+{
+	struct Run *run;
+	uintptr_t va;
+
+	for (run = runs; run < runs + MALLOC_NRUNS; run++)
+		if (run->r_npages >= npages) {
+			if (heap_map(run->r_va, npages, 1) < 0) {
+				heap_map(run->r_va, npages, 0);
+				return NULL;
+			}
+			va = run->r_va;
+			run->r_va += npages * PGSIZE;
+			run->r_npages -= npages;
+			return (struct Chunk *) va;
+		}
+
+	// Keep the break page-aligned for chunks.
+	if (sbrk(ROUNDUP(heap_brk, PGSIZE) - heap_brk) == NULL)
+		return NULL;
+	return sbrk(npages * PGSIZE);
+}
+
+//
+// Unmap a large chunk and remember its range, merged with a neighbor
+// if there is one.  If the range table is full, the range is lost, but
+// the pages are still given back.
+//
+static void
+chunk_free(struct Chunk *ch)
+{
+	uintptr_t va = (uintptr_t) ch, end = va + ch->ch_npages * PGSIZE;
+	uint32_t npages = ch->ch_npages;
+	struct Run *run, *empty = NULL;
+
+	heap_map(va, npages, 0);
+	for (run = runs; run < runs + MALLOC_NRUNS; run++) {
+		if (run->r_npages == 0) {
+			if (!empty)
+				empty = run;
+		} else if (run->r_va + run->r_npages * PGSIZE == va) {
+			run->r_npages += npages;
+			return;
+		} else if (run->r_va == end) {
+			run->r_va = va;
+			run->r_npages += npages;
+			return;
+		}
+	}
+	if (empty) {
+		empty->r_va = va;
+		empty->r_npages = npages;
+	}
+}
+
+//
+// Carve a fresh page into objects of class 'c' for its free list.
+//
+static int
+class_refill(int c)
+{
+	size_t size = MALLOC_MINCLASS << c;
+	char *pg, *obj;
+
+	if ((pg = (char *) chunk_alloc(1)) == NULL)
+		return -E_NO_MEM;
+	heap_class[HEAP_PAGE(pg)] = 1 + c;
+
+	for (obj = pg + PGSIZE - size; obj >= pg; obj -= size) {
+		*(void **) obj = free_list[c];
+		free_list[c] = obj;
+	}
+	return 0;
+}
+
+void *
+malloc(size_t size)
+{
+	struct Chunk *ch;
+	void *obj;
+	uint32_t npages;
+	int c;
+
+	if (size == 0)
+		return NULL;
+
+	if (size <= MALLOC_MAXCLASS) {
+		for (c = 0; (MALLOC_MINCLASS << c) < size; c++)
+			;
+		if (free_list[c] == NULL && class_refill(c) < 0)
+			return NULL;
+		obj = free_list[c];
+		free_list[c] = *(void **) obj;
+		return obj;
+	}
+
+	if (size > UHEAPTOP - UHEAP)
+		return NULL;
+	npages = ROUNDUP(size + sizeof(struct Chunk), PGSIZE) / PGSIZE;
+	if ((ch = chunk_alloc(npages)) == NULL)
+		return NULL;
+	heap_class[HEAP_PAGE(ch)] = 0;
+	ch->ch_magic = CHUNK_MAGIC;
+	ch->ch_npages = npages;
+	return ch + 1;
+}
+
+void
+free(void *ptr)
+{
+	struct Chunk *ch;
+	int c;
+
+	if (ptr == NULL)
+		return;
+	if ((uintptr_t) ptr < UHEAP || (uintptr_t) ptr >= heap_brk)
+		panic("free: bad pointer %08x", ptr);
+
+	if ((c = heap_class[HEAP_PAGE(ptr)]) > 0) {
+		c--;
+		if ((uintptr_t) ptr % (MALLOC_MINCLASS << c) != 0)
+			panic("free: bad pointer %08x", ptr);
+		*(void **) ptr = free_list[c];
+		free_list[c] = ptr;
+	} else {
+		ch = ROUNDDOWN(ptr, PGSIZE);
+		if (ch->ch_magic != CHUNK_MAGIC || ptr != ch + 1)
+			panic("free: bad pointer %08x", ptr);
+		chunk_free(ch);
+	}
+}
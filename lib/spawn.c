@@ -230,12 +230,41 @@ error:
 	return r;
 }
 
+// Pages mapped per sys_page_batch call in map_segment.
+#define MAPBATCH	32
+
+// Run the 'n' operations in 'ops'; return the first error, if any.
+static int
+page_batch(struct Page_op *ops, int n)
+{
+	int i, r;
+
+	if ((r = sys_page_batch(ops, n)) <= 0)
+		return r;
+	for (i = 0; i < n; i++)
+		if (ops[i].result < 0)
+			return ops[i].result;
+	return -E_INVAL;
+}
+
+static void
+page_op(struct Page_op *op, int type, envid_t srcenv, void *srcva,
+	envid_t dstenv, void *dstva, int perm)
+{
+	op->op = type;
+	op->srcenv = srcenv;
+	op->srcva = srcva;
+	op->dstenv = dstenv;
+	op->dstva = dstva;
+	op->perm = perm;
+}
+
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz, 
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	struct Page_op ops[2 * MAPBATCH];
+	int i, j, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -246,25 +275,39 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = read(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	// Pages from the file, MAPBATCH at a time: allocate scratch pages
+	// at UTEMP, read the file into them in one go, then move them
+	// into the child.
+	for (i = 0; i < filesz; i += n * PGSIZE) {
+		n = MIN(MAPBATCH, ROUNDUP(filesz - i, PGSIZE) / PGSIZE);
+		for (j = 0; j < n; j++)
+			page_op(&ops[j], PGOP_ALLOC, 0, 0, 0,
+				UTEMP + j * PGSIZE, PTE_P|PTE_U|PTE_W);
+		if ((r = page_batch(ops, n)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (j = 0; j < n; j++) {
+			page_op(&ops[2 * j], PGOP_MAP, 0, UTEMP + j * PGSIZE,
+				child, (void*) (va + i + j * PGSIZE), perm);
+			page_op(&ops[2 * j + 1], PGOP_UNMAP, 0, 0,
+				0, UTEMP + j * PGSIZE, 0);
 		}
+		if ((r = page_batch(ops, 2 * n)) < 0)
+			panic("spawn: sys_page_batch data: %e", r);
+	}
+
+	// The rest is bss: map demand-zero pages, which the kernel only
+	// gives frames of their own once the child writes to them.
+	for (i = ROUNDUP(filesz, PGSIZE); i < memsz; i += n * PGSIZE) {
+		n = MIN(MAPBATCH, ROUNDUP(memsz - i, PGSIZE) / PGSIZE);
+		for (j = 0; j < n; j++)
+			page_op(&ops[j], PGOP_ALLOC_ZERO, 0, 0, child,
+				(void*) (va + i + j * PGSIZE), perm);
+		if ((r = page_batch(ops, n)) < 0)
+			return r;
 	}
 	return 0;
 }
-
-
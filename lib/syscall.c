@@ -93,6 +93,30 @@ sys_env_set_status(envid_t envid, int status)
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
+int
+sys_env_set_tickets(envid_t envid, int tickets)
+{
+	return syscall(SYS_env_set_tickets, 1, envid, tickets, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_time(uint64_t *ns)
+{
+	return syscall(SYS_time, 0, (uint32_t) ns, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -117,3 +141,64 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_batch(struct Page_op *ops, int n)
+{
+	return syscall(SYS_page_batch, 0, (uint32_t) ops, n, 0, 0, 0);
+}
+
+int
+sys_swap_register(uint32_t nslots)
+{
+	return syscall(SYS_swap_register, 0, nslots, 0, 0, 0, 0);
+}
+
+int
+sys_swap_out(void *va)
+{
+	return syscall(SYS_swap_out, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_swap_in(void *va)
+{
+	return syscall(SYS_swap_in, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_swap_done(uint32_t slot)
+{
+	return syscall(SYS_swap_done, 0, slot, 0, 0, 0, 0);
+}
+
+int
+sys_shm_open(const char *name, uint32_t npages, int flags)
+{
+	return syscall(SYS_shm_open, 0, (uint32_t) name, strlen(name),
+		       npages, flags, 0);
+}
+
+int
+sys_shm_attach(int shmid, void *va, int perm)
+{
+	return syscall(SYS_shm_attach, 0, shmid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_shm_detach(int shmid, void *va)
+{
+	return syscall(SYS_shm_detach, 0, shmid, (uint32_t) va, 0, 0, 0);
+}
+
+int
+sys_shm_remove(int shmid)
+{
+	return syscall(SYS_shm_remove, 0, shmid, 0, 0, 0, 0);
+}
+
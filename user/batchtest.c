@@ -0,0 +1,52 @@
+// A sys_page_batch that unmaps the page holding its own operations.
+// The kernel applies the batch from its own copy and only then stores
+// the results: into whatever is mapped there now, or, if nothing is,
+// the environment is destroyed instead of the kernel faulting.
+
+#include <inc/lib.h>
+
+#define OPS	((struct Page_op *) 0x10000000)
+#define SPARE	((void *) 0x10001000)
+
+static void
+unmap_self(void)
+{
+	OPS[0] = (struct Page_op) { .op = PGOP_UNMAP, .dstva = OPS };
+	OPS[1] = (struct Page_op) { .op = PGOP_ALLOC, .dstva = SPARE,
+				    .perm = PTE_P|PTE_U|PTE_W };
+	sys_page_batch(OPS, 2);
+	panic("results stored into an unmapped page");
+}
+
+void
+umain(void)
+{
+	envid_t who;
+	int r;
+
+	if ((r = sys_page_alloc(0, OPS, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	// Unmap the ops page and map a fresh one in its place: the
+	// results land in the new page, which is otherwise zero.
+	OPS[0] = (struct Page_op) { .op = PGOP_UNMAP, .dstva = OPS,
+				    .result = 1 };
+	OPS[1] = (struct Page_op) { .op = PGOP_ALLOC, .dstva = OPS,
+				    .perm = PTE_P|PTE_U|PTE_W, .result = 1 };
+	if ((r = sys_page_batch(OPS, 2)) != 0)
+		panic("sys_page_batch: %d failed", r);
+	if (OPS[0].op != 0 || OPS[1].op != 0)
+		panic("ops page not replaced");
+	if (OPS[0].result != 0 || OPS[1].result != 0)
+		panic("results not stored in the new page");
+
+	// Unmap it for good, in a child: the child dies, not the kernel.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0)
+		unmap_self();
+	while (envs[ENVX(who)].env_status != ENV_FREE)
+		sys_yield();
+
+	cprintf("batchtest: OK\n");
+}
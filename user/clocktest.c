@@ -0,0 +1,44 @@
+// Check the nanosecond clock and measure what reading it costs, both
+// through sys_time() and through the read-only clock page at UCLOCK.
+
+#include <inc/lib.h>
+
+#define NROUNDS	10000
+
+void
+umain(void)
+{
+	uint64_t start, end, t, prev, ks;
+	int i, r;
+
+	// time_ns() never goes backwards, even across a yield
+	prev = time_ns();
+	for (i = 0; i < NROUNDS; i++) {
+		if (i % 1000 == 0)
+			sys_yield();
+		if ((t = time_ns()) < prev)
+			panic("time_ns went backwards: %llu < %llu", t, prev);
+		prev = t;
+	}
+
+	// the system call and the clock page read the same clock
+	start = time_ns();
+	if ((r = sys_time(&ks)) < 0)
+		panic("sys_time: %e", r);
+	end = time_ns();
+	if (ks < start || ks > end)
+		panic("sys_time %llu not within [%llu, %llu]", ks, start, end);
+	cprintf("%u ms since boot\n", (uint32_t) (ks / 1000000));
+
+	start = time_ns();
+	for (i = 0; i < NROUNDS; i++)
+		sys_time(&t);
+	end = time_ns();
+	cprintf("sys_time: %u ns\n", (uint32_t) ((end - start) / NROUNDS));
+
+	start = time_ns();
+	for (i = 0; i < NROUNDS; i++)
+		time_ns();
+	end = time_ns();
+	cprintf("time_ns: %u ns\n", (uint32_t) ((end - start) / NROUNDS));
+}
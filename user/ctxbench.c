@@ -0,0 +1,43 @@
+// Measure the cost of a null system call and of a context switch.
+// Build the kernel with and without JOS_BIGPAGES to see what keeping
+// kernel translations in the TLB across address space switches buys.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NROUNDS	10000
+
+void
+umain(void)
+{
+	uint64_t start, end;
+	envid_t who;
+	int i;
+
+	// warm up, then time a syscall that does next to nothing
+	sys_getenvid();
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++)
+		sys_getenvid();
+	end = read_tsc();
+	cprintf("null syscall: %u cycles\n",
+		(uint32_t) ((end - start) / NROUNDS));
+
+	// Parent and child yield back and forth, so every sys_yield
+	// switches address spaces.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < NROUNDS; i++)
+			sys_yield();
+		return;
+	}
+
+	sys_yield();
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++)
+		sys_yield();
+	end = read_tsc();
+	cprintf("context switch: %u cycles\n",
+		(uint32_t) ((end - start) / (2 * NROUNDS)));
+}
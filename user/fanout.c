@@ -0,0 +1,54 @@
+// Fork a burst of compute-bound children, forktree-style, half of them
+// pinned to CPU 0, and wait until all are done.  With more than one CPU
+// the others steal the unpinned children from CPU 0, where they were
+// created: the monitor's "envs" and "sched" commands show the
+// migrations and steals.
+
+#include <inc/lib.h>
+
+#define NCHILD	16
+#define NSPIN	2000000
+#define DONE	((volatile uint32_t *) 0x10000000)
+
+static void
+child(void)
+{
+	volatile uint32_t i;
+
+	for (i = 0; i < NSPIN; i++)
+		if (i % (NSPIN / 10) == 0)
+			sys_yield();
+	// Children on other CPUs finish at the same time.
+	asm volatile("lock; incl %0" : "+m" (*DONE));
+}
+
+void
+umain(void)
+{
+	envid_t who;
+	int i, r;
+
+	if ((r = sys_env_set_affinity(0, 0)) != -E_INVAL)
+		panic("empty affinity mask: got %e", r);
+	if ((r = sys_env_set_affinity(0, 1U << 31)) != -E_INVAL)
+		panic("affinity mask of missing CPUs: got %e", r);
+
+	if ((r = sys_page_alloc(0, (void *) DONE,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			child();
+			return;
+		}
+		if (i % 2 == 0 && (r = sys_env_set_affinity(who, 1)) < 0)
+			panic("sys_env_set_affinity: %e", r);
+	}
+
+	while (*DONE < NCHILD)
+		sys_yield();
+	cprintf("fanout: %d children done\n", NCHILD);
+}
@@ -1,4 +1,6 @@
 // idle loop
+// (Only runs with JOS_IDLE_HALT set to 0; see kern/sched.h.  Otherwise
+// the kernel halts the CPU when there is nothing to run.)
 
 #include <inc/x86.h>
 #include <inc/lib.h>
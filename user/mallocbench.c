@@ -0,0 +1,55 @@
+// Time malloc() and free() for small and large objects.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+#include <inc/malloc.h>
+
+#define NOBJS	512
+#define NROUNDS	20
+
+static void *objs[NOBJS];
+
+static void
+bench(size_t size)
+{
+	uint64_t start, end;
+	int i, j;
+
+	start = read_tsc();
+	for (j = 0; j < NROUNDS; j++) {
+		for (i = 0; i < NOBJS; i++)
+			if ((objs[i] = malloc(size)) == NULL)
+				panic("malloc(%d) failed", size);
+		for (i = 0; i < NOBJS; i++)
+			free(objs[i]);
+	}
+	end = read_tsc();
+	cprintf("malloc+free of %5d bytes: %u cycles\n", size,
+		(uint32_t) ((end - start) / (NROUNDS * NOBJS)));
+}
+
+void
+umain(void)
+{
+	char *p;
+	int i;
+
+	// Check that objects don't overlap.
+	for (i = 0; i < NOBJS; i++) {
+		if ((objs[i] = malloc(100)) == NULL)
+			panic("malloc failed");
+		memset(objs[i], i, 100);
+	}
+	for (i = 0; i < NOBJS; i++)
+		for (p = objs[i]; p < (char *) objs[i] + 100; p++)
+			if (*p != (char) i)
+				panic("object %d overwritten", i);
+	for (i = 0; i < NOBJS; i++)
+		free(objs[i]);
+
+	bench(16);
+	bench(100);
+	bench(2048);
+	bench(3 * PGSIZE);
+	cprintf("heap break at %08x\n", sbrk(0));
+}
@@ -0,0 +1,62 @@
+// A low-priority environment must not run while one of a higher
+// priority is runnable, and must share the CPU once both are equal.
+// No environment may raise one above its own priority.
+// Both are pinned to CPU 0, so that with more CPUs an idle one can't
+// just run the child.
+
+#include <inc/lib.h>
+
+#define NROUNDS	1000
+#define COUNTER	((volatile uint32_t *) 0x10000000)
+
+void
+umain(void)
+{
+	envid_t who;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) COUNTER,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((r = sys_env_set_priority(0, ENV_PRIO_MAX)) != -E_INVAL)
+		panic("raised own priority: %e", r);
+
+	// The child inherits the affinity.
+	if ((r = sys_env_set_affinity(0, 1)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+
+	// The child starts out at our priority, so have it block before
+	// it counts, and only let it go once it has been demoted.
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		ipc_recv(0, 0, 0);
+		while (1) {
+			(*COUNTER)++;
+			sys_yield();
+		}
+	}
+	while (envs[ENVX(who)].env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+	if ((r = sys_env_set_priority(who, ENV_PRIO_LOW)) < 0)
+		panic("sys_env_set_priority: %e", r);
+	ipc_send(who, 0, 0, 0);
+
+	for (i = 0; i < NROUNDS; i++)
+		sys_yield();
+	if (*COUNTER != 0)
+		panic("low-priority child ran %d times", *COUNTER);
+
+	if ((r = sys_env_set_priority(0, ENV_PRIO_LOW)) < 0)
+		panic("sys_env_set_priority: %e", r);
+	for (i = 0; i < NROUNDS; i++)
+		sys_yield();
+	if (*COUNTER < NROUNDS / 2)
+		panic("equal-priority child ran only %d times", *COUNTER);
+	if ((r = sys_env_set_priority(who, ENV_PRIO_DEFAULT)) != -E_INVAL)
+		panic("raised child above own priority: %e", r);
+
+	sys_env_destroy(who);
+	cprintf("priotest: priorities are good\n");
+}
@@ -0,0 +1,58 @@
+// Measure the cost of sys_yield as the scheduler sees it: alone, with
+// many environments blocked in ipc_recv (as in the primes chain), and
+// with a few other environments yielding too.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NROUNDS		10000
+#define NBLOCKED	64
+#define NYIELDERS	4
+
+static void
+time_yield(const char *what, int nenvs)
+{
+	uint64_t start, end;
+	int i;
+
+	sys_yield();
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++)
+		sys_yield();
+	end = read_tsc();
+	cprintf("%s: %u cycles per yield\n", what,
+		(uint32_t) ((end - start) / (nenvs * NROUNDS)));
+}
+
+void
+umain(void)
+{
+	envid_t who, blocked[NBLOCKED];
+	int i, j;
+
+	time_yield("alone", 1);
+
+	for (i = 0; i < NBLOCKED; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			ipc_recv(0, 0, 0);
+			return;
+		}
+		blocked[i] = who;
+	}
+	time_yield("alone, 64 blocked", 1);
+	for (i = 0; i < NBLOCKED; i++)
+		ipc_send(blocked[i], 0, 0, 0);
+
+	for (i = 0; i < NYIELDERS; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			for (j = 0; j < NROUNDS; j++)
+				sys_yield();
+			return;
+		}
+	}
+	time_yield("with 4 others", NYIELDERS + 1);
+}
@@ -0,0 +1,48 @@
+// Two spinners with 100 and 300 tickets count how often they get to
+// run.  With the kernel built for stride scheduling (JOS_STRIDE), the
+// second should count about three times as much; the monitor's
+// "shares" command shows the split of CPU time.
+
+#include <inc/lib.h>
+
+#define NCOUNT	100000000
+#define COUNTS	((volatile uint32_t *) 0x10000000)
+
+static envid_t
+spinner(int i, int tickets)
+{
+	envid_t who;
+	int r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0)
+		while (1)
+			COUNTS[i]++;
+	if ((r = sys_env_set_tickets(who, tickets)) < 0)
+		panic("sys_env_set_tickets: %e", r);
+	return who;
+}
+
+void
+umain(void)
+{
+	envid_t a, b;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) COUNTS,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	a = spinner(0, 100);
+	b = spinner(1, 300);
+
+	// Wait for a while, by the spinners' own progress.
+	while (COUNTS[0] + COUNTS[1] < NCOUNT)
+		sys_yield();
+
+	sys_env_destroy(a);
+	sys_env_destroy(b);
+	cprintf("sharetest: 100 tickets counted %u, 300 tickets counted %u\n",
+		COUNTS[0], COUNTS[1]);
+}
@@ -0,0 +1,41 @@
+// Share memory through a named region: the child finds it by name and
+// attaches it at an address of its own.
+
+#include <inc/lib.h>
+
+#define NPAGES	4
+#define PVA	((char *) 0x10000000)
+#define CVA	((char *) 0x20000000)
+
+void
+umain(void)
+{
+	int id, r;
+	envid_t who;
+
+	if ((id = sys_shm_open("shmtest", NPAGES, SHM_CREATE)) < 0)
+		panic("sys_shm_open: %e", id);
+	if ((r = sys_shm_attach(id, PVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_shm_attach: %e", r);
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if ((id = sys_shm_open("shmtest", 0, 0)) < 0)
+			panic("child sys_shm_open: %e", id);
+		if ((r = sys_shm_attach(id, CVA, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("child sys_shm_attach: %e", r);
+		strcpy(CVA + (NPAGES - 1) * PGSIZE, "hello from the child");
+		return;
+	}
+
+	while (envs[ENVX(who)].env_status != ENV_FREE)
+		sys_yield();
+	if (strcmp(PVA + (NPAGES - 1) * PGSIZE, "hello from the child") != 0)
+		panic("shared memory not shared: '%s'",
+		      PVA + (NPAGES - 1) * PGSIZE);
+	cprintf("shmtest: shared memory is good\n");
+
+	sys_shm_detach(id, PVA);
+	sys_shm_remove(id);
+}
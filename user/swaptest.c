@@ -0,0 +1,31 @@
+// Touch more memory than the machine has, then check it all, so that
+// pages have to go out to swap and come back.
+
+#include <inc/lib.h>
+
+#define BASE	0x10000000
+#define NPAGES	8192		// 32MB
+
+void
+umain(void)
+{
+	uint32_t i, n;
+	int r;
+
+	for (n = 0; n < NPAGES; n++) {
+		if ((r = sys_page_alloc(0, (void *) (BASE + n * PGSIZE),
+					PTE_P|PTE_U|PTE_W)) < 0) {
+			cprintf("out of memory and swap after %d pages: %e\n",
+				n, r);
+			break;
+		}
+		*(uint32_t *) (BASE + n * PGSIZE) = n;
+	}
+
+	for (i = 0; i < n; i++)
+		if (*(uint32_t *) (BASE + i * PGSIZE) != i)
+			panic("page %d holds %d", i, *(uint32_t *) (BASE + i * PGSIZE));
+
+	cprintf("%d pages ok, %d swapped out, %d swapped in\n",
+		n, env->env_swapouts, env->env_swapins);
+}